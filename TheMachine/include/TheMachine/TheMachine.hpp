@@ -1,22 +1,48 @@
 #pragma once
 
+#include <memory>
 #include <random>
 
 #include <opencv2/core.hpp>
 #include <YoloV5/yolov5.hpp>
 
+#include "TheMachine/preprocessing.hpp"
 #include "TheMachine/utils.hpp"
 
 /// <summary>
-/// Simple struct to store a preprocessed image
+/// Simple struct to store a loaded image and
+/// where it goes in the detector input
 /// </summary>
 struct PreprocessedImage
 {
+	// Decoded image, can be smaller than the file
+	// image with reduced JPEG decoding
 	cv::Mat original;
-	cv::Mat im;
-	float ratio;
-	int pad_x;
-	int pad_y;
+	// Size of the image in the file
+	int original_width;
+	int original_height;
+	LetterboxGeometry letterbox;
+};
+
+/// <summary>
+/// Options of the tiled detection mode
+/// </summary>
+struct TilingOptions
+{
+	// Size of the square tiles, processed at native
+	// resolution. Must be a multiple of the detector stride
+	int tile_size = 640;
+	// Minimum overlap between two neighbour tiles, in pixels
+	int overlap = 128;
+	// Number of tiles processed in one forward
+	int batch_size = 4;
+	// If true, the whole image is also processed at
+	// process_size to detect objects larger than the tiles
+	bool full_frame = false;
+	// Max number of detections in the whole image. If 0, the
+	// max_det of the NMS options is given to each tile/pass.
+	// max_nms is always applied on each tile separately
+	int max_det = 0;
 };
 
 class TheMachine
@@ -31,8 +57,21 @@ public:
 	/// <param name="process_size_">The size of the images passed to the detector</param>
 	/// <param name="device_">Torch device used for operations (default CPU)</param>
 	/// <param name="boring_ui_">If true, display a simple rectangle around detections instead of cooler UI</param>
+	/// <param name="precision">Type used for the detector weights and activations (kFloat, kBFloat16 or kHalf)</param>
 	TheMachine(const std::string& detector_yaml_file,
 		const std::string& detector_weights_file,
+		const int process_size_ = 640, const torch::Device device_ = torch::kCPU,
+		const bool boring_ui_ = false, const torch::Dtype precision = torch::kFloat);
+
+	/// <summary>
+	/// Constructor
+	/// </summary>
+	/// <param name="detector_snapshot_file">Snapshot file saved with YoloV5::SaveSnapshot,
+	/// the detector uses the precision of the saved weights</param>
+	/// <param name="process_size_">The size of the images passed to the detector</param>
+	/// <param name="device_">Torch device used for operations (default CPU)</param>
+	/// <param name="boring_ui_">If true, display a simple rectangle around detections instead of cooler UI</param>
+	TheMachine(const std::string& detector_snapshot_file,
 		const int process_size_ = 640, const torch::Device device_ = torch::kCPU,
 		const bool boring_ui_ = false);
 	~TheMachine();
@@ -45,10 +84,89 @@ public:
 	/// </summary>
 	/// <param name="path">Image to process</param>
 	/// <param name="save_path">If not empty, save the result here</param>
-	void Detect(const std::string& path, const std::string& save_path = "");
+	/// <returns>The detections, in the coordinates of the image file even
+	/// if it was decoded at reduced resolution</returns>
+	std::vector<Detection> Detect(const std::string& path, const std::string& save_path = "");
+
+	/// <summary>
+	/// Detect objects in several images and display the results.
+	/// Images are packed together on process_size canvases, without
+	/// upscaling, and each canvas is processed with a single forward,
+	/// which is much faster than Detect for small images.
+	/// </summary>
+	/// <param name="paths">Images to process</param>
+	/// <param name="save_paths">If not empty, save the result of paths[i] in save_paths[i]</param>
+	/// <returns>The detections of each image, in the coordinates of its file</returns>
+	std::vector<std::vector<Detection> > DetectMosaic(const std::vector<std::string>& paths, const std::vector<std::string>& save_paths = {});
+
+	/// <summary>
+	/// Switch the detector convolutions to int8 (CPU and fp32 only).
+	/// If a calibration folder is given, its images are used to
+	/// calibrate the activations and the parameters are saved in
+	/// int8_params_file, otherwise they are loaded from it.
+	/// </summary>
+	/// <param name="int8_params_file">File to save/load int8 parameters</param>
+	/// <param name="calibration_folder">Folder with representative images</param>
+	void QuantizeInt8(const std::string& int8_params_file, const std::string& calibration_folder = "");
+
+	/// <summary>
+	/// Run the detector with channels last (NHWC) activations,
+	/// which is also the layout of the OpenCV images
+	/// </summary>
+	/// <param name="channels_last">If true, use channels last, otherwise contiguous NCHW</param>
+	void SetChannelsLast(const bool channels_last);
+
+	/// <summary>
+	/// Pack the detector conv weights once for the processed
+	/// image size (see YoloV5Impl::SetPrepacked)
+	/// </summary>
+	/// <param name="prepacked">If true, use prepacked convs</param>
+	void SetPrepacked(const bool prepacked);
+
+	/// <summary>
+	/// Process images as overlapping tiles at native resolution,
+	/// batched together, instead of downscaling them to process_size.
+	/// Detections of all tiles are merged with a global NMS.
+	/// </summary>
+	/// <param name="tiled_">If true, use tiled detection</param>
+	/// <param name="options">Tiles size, overlap and batching</param>
+	void SetTiling(const bool tiled_, const TilingOptions& options = TilingOptions());
+
+	/// <summary>
+	/// Create another machine with the same settings, whose
+	/// detector shares this one's weights instead of copying
+	/// them (see YoloV5Impl::Replicate)
+	/// </summary>
+	/// <returns>The new machine</returns>
+	std::unique_ptr<TheMachine> Replicate() const;
 
 private:
+	TheMachine(YoloV5 detector_, const int process_size_,
+		const torch::Device device_, const bool boring_ui_);
+	void Init();
 	PreprocessedImage Preprocess(const std::string& path);
+	torch::Tensor ToTensor(const PreprocessedImage& img);
+	/// <summary>
+	/// Get the persistent CPU input tensor, only
+	/// reallocated if the requested shape changes
+	/// </summary>
+	torch::Tensor GetInputBuffer(const int batch_size, const int height, const int width);
+	/// <summary>
+	/// Detect candidates in the letterboxed image
+	/// </summary>
+	/// <returns>[num candidates, 6] in decoded image coordinates</returns>
+	torch::Tensor DetectFullFrame(const PreprocessedImage& img);
+	/// <summary>
+	/// Detect candidates in all the tiles of the image
+	/// </summary>
+	/// <returns>For each tile, [num candidates, 6] in decoded image coordinates</returns>
+	std::vector<torch::Tensor> DetectTiles(const cv::Mat& img);
+	/// <summary>
+	/// Draw, save and display the detections of an image
+	/// </summary>
+	/// <param name="output">[num det, 6] in decoded image coordinates</param>
+	/// <returns>The detections in the coordinates of the image file</returns>
+	std::vector<Detection> ShowResults(PreprocessedImage& img, torch::Tensor output, const std::string& save_path);
 	std::vector<Detection> PostProcess(const torch::Tensor& output_);
 	void PlotResults(cv::Mat& img, const std::vector<Detection>& detections);
 
@@ -56,8 +174,12 @@ private:
 	YoloV5 detector;
 	int process_size;
 	torch::Device device;
-	std::vector<int> class_filter;
+	NMSOptions nms_options;
+	// Detector input, reused from one image to the next
+	torch::Tensor input_buffer;
 	std::mt19937 random_engine;
 	std::uniform_int_distribution<int> color_distrib;
 	bool boring_ui;
+	bool tiled;
+	TilingOptions tiling_options;
 };
\ No newline at end of file
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+
+#include <opencv2/core.hpp>
+#include <torch/torch.h>
+
+/// <summary>
+/// Read the size of a JPEG image from its frame
+/// header, without decoding anything
+/// </summary>
+/// <param name="path">Image file</param>
+/// <param name="width">Width of the image if found</param>
+/// <param name="height">Height of the image if found</param>
+/// <returns>True if the file is a JPEG with a valid frame header</returns>
+bool ReadJpegSize(const std::string& path, int& width, int& height);
+
+/// <summary>
+/// Load an image as HWC BGR uint8. JPEG images large enough
+/// compared to process_size are decoded at 1/2, 1/4 or 1/8
+/// of their size directly in the DCT domain, which is much
+/// faster than decoding everything and downsampling after.
+/// </summary>
+/// <param name="path">Image file</param>
+/// <param name="process_size">Size of the largest side of the detector input,
+/// if 0 the image is always decoded at full resolution</param>
+/// <param name="width">Width of the image in the file</param>
+/// <param name="height">Height of the image in the file</param>
+/// <returns>The decoded image, possibly smaller than width x height</returns>
+cv::Mat LoadImage(const std::string& path, const int process_size, int& width, int& height);
+
+/// <summary>
+/// Position of an image resized and padded
+/// (letterboxed) in the detector input
+/// </summary>
+struct LetterboxGeometry
+{
+	// Scale between the source image and the resized one
+	float ratio;
+	// Position of the resized image in the input
+	int pad_x;
+	int pad_y;
+	// Size of the resized image, without padding
+	int resized_width;
+	int resized_height;
+	// Size of the input, with padding
+	int width;
+	int height;
+};
+
+/// <summary>
+/// Compute the letterbox geometry of an image so its largest
+/// side is process_size, and its smallest side is padded
+/// to the next multiple of stride
+/// </summary>
+/// <param name="src_width">Width of the source image</param>
+/// <param name="src_height">Height of the source image</param>
+/// <param name="process_size">Size of the largest side in the input</param>
+/// <param name="stride">Input sizes are multiple of this</param>
+/// <returns>The geometry of the letterboxed image</returns>
+LetterboxGeometry ComputeLetterbox(const int src_width, const int src_height, const int process_size, const int stride);
+
+/// <summary>
+/// Start positions of overlapping tiles covering [0, size[.
+/// The last tile is aligned on the end, so only
+/// the first and the last ones can overlap more.
+/// </summary>
+/// <param name="size">Size of the image along this axis</param>
+/// <param name="tile_size">Size of a tile</param>
+/// <param name="overlap">Minimum overlap between two consecutive tiles</param>
+/// <returns>Start of each tile</returns>
+std::vector<int> ComputeTileStarts(const int size, const int tile_size, const int overlap);
+
+/// <summary>
+/// Position of an image in a mosaic
+/// </summary>
+struct MosaicPlacement
+{
+	// Index of the canvas the image is in
+	int canvas;
+	// Position and size of the image in the canvas
+	cv::Rect rect;
+};
+
+/// <summary>
+/// Pack images on as few canvases as possible with a shelf
+/// algorithm (next fit by decreasing height). Neighbour
+/// images are separated by guard bands of guard pixels.
+/// </summary>
+/// <param name="sizes">Size of each image, must fit in a canvas</param>
+/// <param name="canvas_width">Width of a canvas</param>
+/// <param name="canvas_height">Height of a canvas</param>
+/// <param name="guard">Space between two images</param>
+/// <returns>Placement of each image, in the same order as sizes</returns>
+std::vector<MosaicPlacement> PackMosaic(const std::vector<cv::Size>& sizes,
+	const int canvas_width, const int canvas_height, const int guard);
+
+/// <summary>
+/// Bilinear resize, pad and convert a HWC BGR uint8 image to
+/// dst in a single multithreaded pass. dst can have any strides
+/// (NCHW or channels last slot of a batch tensor). Padding is
+/// filled with 128.
+/// </summary>
+/// <param name="src">Source image, CV_8UC3</param>
+/// <param name="geometry">Geometry computed with ComputeLetterbox</param>
+/// <param name="dst">[3, height, width] tensor, kByte or kFloat, on CPU</param>
+/// <param name="normalize">If true, dst is kFloat and gets RGB values in [0, 1],
+/// otherwise it gets BGR values in [0, 255]</param>
+void Letterbox(const cv::Mat& src, const LetterboxGeometry& geometry, torch::Tensor dst, const bool normalize);
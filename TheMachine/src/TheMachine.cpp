@@ -1,4 +1,5 @@
 #include <chrono>
+#include <limits>
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -8,11 +9,83 @@
 
 TheMachine::TheMachine(const std::string& detector_yaml_file, 
     const std::string& detector_weights_file, const int process_size_,
-    const torch::Device device_, const bool boring_ui_) : detector(detector_yaml_file, 3),
-    process_size(process_size_), device(device_), boring_ui(boring_ui_)
+    const torch::Device device_, const bool boring_ui_, const torch::Dtype precision) :
+    detector(detector_yaml_file, 3), process_size(process_size_),
+    device(device_), boring_ui(boring_ui_)
 {
     detector->LoadWeights(detector_weights_file);
     detector->FuseConvAndBN();
+    detector->SetPrecision(precision);
+    Init();
+}
+
+TheMachine::TheMachine(const std::string& detector_snapshot_file,
+    const int process_size_, const torch::Device device_, const bool boring_ui_) :
+    detector(detector_snapshot_file), process_size(process_size_),
+    device(device_), boring_ui(boring_ui_)
+{
+    Init();
+}
+
+TheMachine::TheMachine(YoloV5 detector_, const int process_size_,
+    const torch::Device device_, const bool boring_ui_) :
+    detector(detector_), process_size(process_size_),
+    device(device_), boring_ui(boring_ui_)
+{
+    Init();
+}
+
+TheMachine::~TheMachine()
+{
+
+}
+
+void TheMachine::SetChannelsLast(const bool channels_last)
+{
+    detector->SetChannelsLast(channels_last);
+}
+
+void TheMachine::SetPrepacked(const bool prepacked)
+{
+    detector->SetPrepacked(prepacked);
+}
+
+void TheMachine::SetTiling(const bool tiled_, const TilingOptions& options)
+{
+    if (tiled_)
+    {
+        if (options.tile_size <= 0 || options.tile_size % detector->GetMaxStride() != 0)
+        {
+            throw std::runtime_error("Tile size must be a multiple of " + std::to_string(detector->GetMaxStride()));
+        }
+        if (options.overlap < 0 || options.overlap >= options.tile_size)
+        {
+            throw std::runtime_error("Tile overlap must be in [0, tile size[");
+        }
+        if (options.batch_size < 1)
+        {
+            throw std::runtime_error("Tile batch size must be at least 1");
+        }
+    }
+
+    tiled = tiled_;
+    tiling_options = options;
+}
+
+std::unique_ptr<TheMachine> TheMachine::Replicate() const
+{
+    std::unique_ptr<TheMachine> replica(new TheMachine(detector->Replicate(), process_size, device, boring_ui));
+    replica->SetTiling(tiled, tiling_options);
+    return replica;
+}
+
+void TheMachine::Init()
+{
+    tiled = false;
+
+    detector->FuseGraph();
+    // Images are given to the detector as raw uint8 BGR
+    detector->FoldInputNormalization();
     detector->eval();
     detector->to(device);
 
@@ -21,7 +94,10 @@ TheMachine::TheMachine(const std::string& detector_yaml_file,
         // We're only interested in person, car, truck, bus,
         // airplane, boat and train, 
         // not in broccoli, hot dog or hair drier
-        class_filter = { 0, 2, 4, 5, 6, 7, 8 };
+        nms_options.classes = { 0, 2, 4, 5, 6, 7, 8 };
+        // Don't even compute the scores of the other classes. The
+        // best class of a box is then among these ones only
+        detector->RestrictClasses(nms_options.classes);
     }
 
     std::random_device rd;
@@ -29,45 +105,158 @@ TheMachine::TheMachine(const std::string& detector_yaml_file,
     color_distrib = std::uniform_int_distribution<int>(0, 255);
 }
 
-TheMachine::~TheMachine()
+std::vector<Detection> TheMachine::Detect(const std::string& path, const std::string& save_path)
 {
+    int max_stride = detector->GetMaxStride();
+
+    std::cout << "Processing image: " << path << std::endl;
+
+    PreprocessedImage img = Preprocess(path);
+
+    // Candidates of all the passes on the image
+    std::vector<torch::Tensor> candidates;
+    if (!tiled || tiling_options.full_frame)
+    {
+        candidates.push_back(DetectFullFrame(img));
+    }
+    if (tiled)
+    {
+        const std::vector<torch::Tensor> tiles_candidates = DetectTiles(img.original);
+        candidates.insert(candidates.end(), tiles_candidates.begin(), tiles_candidates.end());
+    }
 
+    NMSOptions merge_options = nms_options;
+    if (tiled)
+    {
+        // Limits are for a single detector input, so max_nms is applied
+        // on each pass and max_det grows with the number of passes
+        for (torch::Tensor& c : candidates)
+        {
+            if (nms_options.max_nms >= 0 && c.size(0) > nms_options.max_nms)
+            {
+                c = c.index_select(0, std::get<1>(c.select(1, 4).topk(nms_options.max_nms)));
+            }
+        }
+        merge_options.max_nms = std::numeric_limits<int>::max();
+        merge_options.max_det = tiling_options.max_det > 0 ? tiling_options.max_det :
+            nms_options.max_det * static_cast<int>(candidates.size());
+    }
+
+    // Merge everything with a global NMS
+    torch::Tensor output = detector->NonMaxSuppression(
+        { candidates.size() == 1 ? candidates[0] : torch::cat(candidates) }, merge_options)[0];
+
+    return ShowResults(img, output, save_path);
 }
 
-void TheMachine::Detect(const std::string& path, const std::string& save_path)
+std::vector<std::vector<Detection> > TheMachine::DetectMosaic(const std::vector<std::string>& paths, const std::vector<std::string>& save_paths)
 {
-    int max_stride = detector->GetMaxStride();
+    const int stride = detector->GetMaxStride();
+    const int canvas_size = (process_size + stride - 1) / stride * stride;
+    // Space between images, filled as padding
+    const int guard = stride / 2;
+    const bool raw_input = detector->IsRawInput();
+
+    std::vector<PreprocessedImage> images;
+    std::vector<cv::Size> sizes;
+    images.reserve(paths.size());
+    sizes.reserve(paths.size());
+    for (const std::string& path : paths)
+    {
+        std::cout << "Processing image: " << path << std::endl;
 
-    std::cout << "Processing image: " << path << std::endl;
+        PreprocessedImage img = Preprocess(path);
 
-    PreprocessedImage img = Preprocess(path);
+        // Images are only downscaled if they don't fit in the canvas
+        LetterboxGeometry& g = img.letterbox;
+        g.ratio = std::min({ 1.0f, static_cast<float>(canvas_size) / img.original.rows, static_cast<float>(canvas_size) / img.original.cols });
+        g.resized_width = std::min(canvas_size, static_cast<int>(std::round(img.original.cols * g.ratio)));
+        g.resized_height = std::min(canvas_size, static_cast<int>(std::round(img.original.rows * g.ratio)));
+        g.width = canvas_size;
+        g.height = canvas_size;
+
+        sizes.emplace_back(g.resized_width, g.resized_height);
+        images.push_back(img);
+    }
+
+    const std::vector<MosaicPlacement> placements = PackMosaic(sizes, canvas_size, canvas_size, guard);
+
+    std::vector<std::vector<size_t> > canvas_images;
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        if (static_cast<size_t>(placements[i].canvas) >= canvas_images.size())
+        {
+            canvas_images.resize(placements[i].canvas + 1);
+        }
+        canvas_images[placements[i].canvas].push_back(i);
+        images[i].letterbox.pad_x = placements[i].rect.x;
+        images[i].letterbox.pad_y = placements[i].rect.y;
+    }
+
+    torch::Tensor buffer = GetInputBuffer(1, canvas_size, canvas_size);
+
+    // Candidates of each image, in decoded image coordinates
+    std::vector<torch::Tensor> candidates(images.size());
+    for (const std::vector<size_t>& indices : canvas_images)
+    {
+        // Guard bands and empty space are filled like letterbox padding
+        buffer.fill_(raw_input ? 128.0 : 128.0 / 255.0);
+        for (const size_t i : indices)
+        {
+            const LetterboxGeometry& g = images[i].letterbox;
+            const LetterboxGeometry resize{ g.ratio, 0, 0, g.resized_width, g.resized_height, g.resized_width, g.resized_height };
+            Letterbox(images[i].original, resize,
+                buffer[0].narrow(1, g.pad_y, g.resized_height).narrow(2, g.pad_x, g.resized_width), !raw_input);
+        }
+
+        torch::Tensor input = buffer.to(device);
+        if (!raw_input)
+        {
+            input = input.to(detector->GetPrecision());
+        }
 
-    // Create HWC, B, G, R tensor
-    torch::Tensor input = torch::from_blob(img.im.data, { img.im.rows, img.im.cols, img.im.channels() }, torch::TensorOptions().dtype(torch::kByte));
+        const torch::Tensor canvas_candidates = detector->DetectCandidates(input, nms_options)[0];
+        const torch::Tensor center_x = (canvas_candidates.select(1, 0) + canvas_candidates.select(1, 2)) / 2.0f;
+        const torch::Tensor center_y = (canvas_candidates.select(1, 1) + canvas_candidates.select(1, 3)) / 2.0f;
 
-    // Convert to CHW, R,G,B
-    input = input.permute({ 2,0,1 }).flip(0);
+        // Each candidate belongs to the image its center is in
+        for (const size_t i : indices)
+        {
+            const LetterboxGeometry& g = images[i].letterbox;
+            const torch::Tensor mask = (center_x >= g.pad_x) & (center_x < g.pad_x + g.resized_width) &
+                (center_y >= g.pad_y) & (center_y < g.pad_y + g.resized_height);
 
-    // Add one batch channel
-    input = input.unsqueeze(0);
+            torch::Tensor image_candidates = canvas_candidates.index({ mask });
+            // Don't let boxes overflow on the neighbour images
+            image_candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 3, 2) }).clamp_(g.pad_x, g.pad_x + g.resized_width);
+            image_candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(1, 4, 2) }).clamp_(g.pad_y, g.pad_y + g.resized_height);
 
-    // Transfer to GPU if necessary, then convert to float
-    input = input.to(device).to(torch::kFloat) / 255.0f;
+            image_candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 3, 2) }) -= g.pad_x;
+            image_candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(1, 4, 2) }) -= g.pad_y;
+            image_candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 4) }) /= g.ratio;
 
-    // Pass the image through YoloV5 and apply NMS
-    torch::Tensor output = detector->forward(input);
-    output = detector->NonMaxSuppression(output)[0];
+            candidates[i] = image_candidates;
+        }
+    }
 
-    // Retransform the output to get boxes wrt the original image
-    output.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 3, 2) }) -= img.pad_x;
-    output.index({ torch::indexing::Slice(), torch::indexing::Slice(1, 4, 2) }) -= img.pad_y;
-    output.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 4) }) /= img.ratio;
+    // NMS is done per image, so images don't suppress each other
+    std::vector<torch::Tensor> outputs = detector->NonMaxSuppression(candidates, nms_options);
 
-    // Transform tensor into Detection
-    std::vector<Detection> detections = PostProcess(output);
+    std::vector<std::vector<Detection> > detections(images.size());
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        detections[i] = ShowResults(images[i], outputs[i], i < save_paths.size() ? save_paths[i] : "");
+    }
 
-    // Draw the detections
-    PlotResults(img.original, detections);
+    return detections;
+}
+
+std::vector<Detection> TheMachine::ShowResults(PreprocessedImage& img, torch::Tensor output, const std::string& save_path)
+{
+    // Transform tensor into Detection and draw
+    // them on the decoded image
+    const std::vector<Detection> decoded_detections = PostProcess(output);
+    PlotResults(img.original, decoded_detections);
 
     if (!save_path.empty())
     {
@@ -78,40 +267,175 @@ void TheMachine::Detect(const std::string& path, const std::string& save_path)
 
     cv::imshow("TheMachine", img.original);
     cv::waitKey(0);
+
+    // Undo the reduced decoding
+    const float decode_scale_x = static_cast<float>(img.original_width) / img.original.cols;
+    const float decode_scale_y = static_cast<float>(img.original_height) / img.original.rows;
+    std::vector<Detection> detections = decoded_detections;
+    for (Detection& d : detections)
+    {
+        d.x1 *= decode_scale_x;
+        d.x2 *= decode_scale_x;
+        d.y1 *= decode_scale_y;
+        d.y2 *= decode_scale_y;
+    }
+
+    return detections;
 }
 
-PreprocessedImage TheMachine::Preprocess(const std::string& path)
+void TheMachine::QuantizeInt8(const std::string& int8_params_file, const std::string& calibration_folder)
 {
-    // Load image (HWC, B,G,R)
-    cv::Mat img = cv::imread(path, cv::IMREAD_COLOR);
+    if (calibration_folder.empty())
+    {
+        detector->LoadInt8Params(int8_params_file);
+        return;
+    }
 
-    const float ratio = std::min(static_cast<float>(process_size) / img.rows, static_cast<float>(process_size) / img.cols);
+    std::vector<cv::String> files;
+    cv::glob(calibration_folder, files, false);
 
-    if (ratio == 1.0f)
+    size_t num_images = 0;
+    for (const cv::String& file : files)
     {
-        return PreprocessedImage{ img, img, 1.0f, 0, 0 };
+        PreprocessedImage img;
+        try
+        {
+            img = Preprocess(file);
+        }
+        catch (const std::runtime_error&)
+        {
+            // Skip files that are not images
+            continue;
+        }
+        detector->CalibrateInt8(ToTensor(img));
+        num_images += 1;
     }
 
+    if (num_images == 0)
+    {
+        throw std::runtime_error("No calibration image found in " + calibration_folder);
+    }
+    std::cout << "Int8 calibration done with " << num_images << " images" << std::endl;
+
+    detector->QuantizeInt8();
+    detector->SaveInt8Params(int8_params_file);
+}
+
+PreprocessedImage TheMachine::Preprocess(const std::string& path)
+{
+    // Load image (HWC, B,G,R), at reduced size if possible
+    int width, height;
+    // Tiles are processed at native resolution, the image can't be reduced
+    cv::Mat img = LoadImage(path, tiled ? 0 : process_size, width, height);
+
+    // Resizing and padding are done later, directly in the detector input
+    return PreprocessedImage{ img, width, height, ComputeLetterbox(img.cols, img.rows, process_size, detector->GetMaxStride()) };
+}
+
+torch::Tensor TheMachine::DetectFullFrame(const PreprocessedImage& img)
+{
+    torch::Tensor input = ToTensor(img);
+
+    // Pass the image through YoloV5, only decode the candidate boxes
+    torch::Tensor candidates = detector->DetectCandidates(input, nms_options)[0];
+
+    // Retransform the candidates to get boxes wrt the decoded image.
+    // IoU doesn't change, so it can be done before NMS
+    candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 3, 2) }) -= img.letterbox.pad_x;
+    candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(1, 4, 2) }) -= img.letterbox.pad_y;
+    candidates.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 4) }) /= img.letterbox.ratio;
+
+    return candidates;
+}
+
+std::vector<torch::Tensor> TheMachine::DetectTiles(const cv::Mat& img)
+{
     const int stride = detector->GetMaxStride();
+    const bool raw_input = detector->IsRawInput();
 
-    const int pad_h = std::round(img.rows * ratio);
-    const int pad_w = std::round(img.cols * ratio);
+    // Tiles don't need to be larger than the image
+    const int tile_width = std::min(tiling_options.tile_size, (img.cols + stride - 1) / stride * stride);
+    const int tile_height = std::min(tiling_options.tile_size, (img.rows + stride - 1) / stride * stride);
 
-    const float delta_w = (process_size - pad_w) % stride / 2.0f;
-    const float delta_h = (process_size - pad_h) % stride / 2.0f;
+    std::vector<cv::Rect> tiles;
+    for (const int y : ComputeTileStarts(img.rows, tile_height, tiling_options.overlap))
+    {
+        for (const int x : ComputeTileStarts(img.cols, tile_width, tiling_options.overlap))
+        {
+            tiles.emplace_back(x, y, std::min(tile_width, img.cols - x), std::min(tile_height, img.rows - y));
+        }
+    }
 
-    cv::Mat resized;
-    cv::resize(img, resized, cv::Size(pad_w, pad_h), 0.0, 0.0, cv::INTER_LINEAR);
+    const int batch_size = std::min(static_cast<int>(tiles.size()), tiling_options.batch_size);
+    torch::Tensor buffer = GetInputBuffer(batch_size, tile_height, tile_width);
 
-    const int top = std::round(delta_h - 0.1f);
-    const int bottom = std::round(delta_h + 0.1f);
-    const int left = std::round(delta_w - 0.1f);
-    const int right = std::round(delta_w + 0.1f);
+    std::vector<torch::Tensor> candidates;
+    candidates.reserve(tiles.size());
+    for (size_t first = 0; first < tiles.size(); first += batch_size)
+    {
+        const int count = static_cast<int>(std::min(static_cast<size_t>(batch_size), tiles.size() - first));
 
-    cv::Mat output;
-    cv::copyMakeBorder(resized, output, top, bottom, left, right, cv::BORDER_CONSTANT, cv::Scalar(128, 128, 128));
+        // Tiles are copied at native resolution, only
+        // the ones on the right and bottom are padded
+        for (int i = 0; i < count; ++i)
+        {
+            const cv::Rect& tile = tiles[first + i];
+            const LetterboxGeometry geometry{ 1.0f, 0, 0, tile.width, tile.height, tile_width, tile_height };
+            Letterbox(img(tile), geometry, buffer[i], !raw_input);
+        }
 
-    return PreprocessedImage{img, output, ratio, left, top };
+        torch::Tensor input = buffer.narrow(0, 0, count).to(device);
+        if (!raw_input)
+        {
+            input = input.to(detector->GetPrecision());
+        }
+
+        std::vector<torch::Tensor> tiles_candidates = detector->DetectCandidates(input, nms_options);
+        for (int i = 0; i < count; ++i)
+        {
+            // Move the boxes to image coordinates
+            tiles_candidates[i].index({ torch::indexing::Slice(), torch::indexing::Slice(0, 3, 2) }) += tiles[first + i].x;
+            tiles_candidates[i].index({ torch::indexing::Slice(), torch::indexing::Slice(1, 4, 2) }) += tiles[first + i].y;
+            candidates.push_back(tiles_candidates[i]);
+        }
+    }
+
+    return candidates;
+}
+
+torch::Tensor TheMachine::GetInputBuffer(const int batch_size, const int height, const int width)
+{
+    // Normalization and BGR to RGB are folded in the detector weights,
+    // which converts the raw input to its own precision
+    const torch::Dtype dtype = detector->IsRawInput() ? torch::kByte : torch::kFloat;
+    const torch::MemoryFormat format = detector->IsChannelsLast() ? torch::MemoryFormat::ChannelsLast : torch::MemoryFormat::Contiguous;
+
+    if (!input_buffer.defined() ||
+        input_buffer.sizes() != torch::IntArrayRef({ batch_size, 3, height, width }) ||
+        input_buffer.scalar_type() != dtype ||
+        !input_buffer.is_contiguous(format))
+    {
+        input_buffer = torch::empty({ batch_size, 3, height, width }, torch::TensorOptions().dtype(dtype).memory_format(format));
+    }
+
+    return input_buffer;
+}
+
+torch::Tensor TheMachine::ToTensor(const PreprocessedImage& img)
+{
+    torch::Tensor input = GetInputBuffer(1, img.letterbox.height, img.letterbox.width);
+
+    // Resize, pad and convert to the layout of the input in one pass
+    Letterbox(img.original, img.letterbox, input[0], !detector->IsRawInput());
+
+    // Transfer to GPU if necessary, no-op on CPU
+    input = input.to(device);
+    if (!detector->IsRawInput())
+    {
+        input = input.to(detector->GetPrecision());
+    }
+
+    return input;
 }
 
 std::vector<Detection> TheMachine::PostProcess(const torch::Tensor& output_)
@@ -126,22 +450,10 @@ std::vector<Detection> TheMachine::PostProcess(const torch::Tensor& output_)
     // Revert order so highest scores are first
     for (int i = output.size(0) - 1; i > -1; --i)
     {
-        const int cls = static_cast<int>(results_ptr[i * 6 + 5]);
-        bool kept_class = class_filter.size() == 0;
-        for (size_t j = 0; j < class_filter.size(); j++)
-        {
-            if (class_filter[j] == cls)
-            {
-                kept_class = true;
-                break;
-            }
-        }
-        if (kept_class)
-        {
-            detections.push_back({ results_ptr[i * 6 + 0], results_ptr[i * 6 + 1] ,
+        // Classes are already filtered during NMS
+        detections.push_back({ results_ptr[i * 6 + 0], results_ptr[i * 6 + 1] ,
             results_ptr[i * 6 + 2] , results_ptr[i * 6 + 3],
-            results_ptr[i * 6 + 4], cls });
-        }
+            results_ptr[i * 6 + 4], static_cast<int>(results_ptr[i * 6 + 5]) });
     }
 
     return detections;
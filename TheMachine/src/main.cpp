@@ -7,8 +7,21 @@ void ShowHelp(const char* argv0)
         << "\t-h, --help\tShow this help message\n"
         << "\t--model\tPath to the yaml file to use to build YoloV5 net, default: yolov5s.yaml\n"
         << "\t--weights\tPath to the .pt file containing trained weights for YoloV5, default: yolov5s.pt\n"
-        << "\t--path\tPath to the image to process, default: empty\n"
-        << "\t--save\tIf set, save the resulting image on the disk, default: empty\n"
+        << "\t--snapshot\tPath to a snapshot file to load instead of model and weights, default: empty\n"
+        << "\t--compile\tIf set, save a snapshot of model and weights at this path and exit, default: empty\n"
+        << "\t--path\tPath to the image to process, can be repeated to process several images\n"
+        << "\t--save\tIf set, save the resulting image on the disk, repeat it to save the result of each --path, default: empty\n"
+        << "\t--mosaic\tIf set, pack all the images given with --path on shared canvases, which is faster for small images\n"
+        << "\t--precision\tType used for weights and activations, fp32, bf16 or fp16. Also used to save the snapshot with --compile, default: fp32\n"
+        << "\t--int8\tIf set, run the detector convolutions in int8 (CPU and fp32 only), with parameters loaded from <weights or snapshot>.int8\n"
+        << "\t--calibration\tWith --int8, folder of images used to calibrate int8 parameters, which are then saved in <weights or snapshot>.int8, default: empty\n"
+        << "\t--channels_last\tIf set, keep activations in channels last (NHWC) memory format\n"
+        << "\t--prepack\tIf set, pack the conv weights once in oneDNN layout (CPU and fp32 only)\n"
+        << "\t--tile\tIf set, process the image as overlapping tiles of this size at native resolution, default: 0 (disabled)\n"
+        << "\t--tile_overlap\tWith --tile, minimum overlap between tiles in pixels, default: 128\n"
+        << "\t--tile_batch\tWith --tile, number of tiles processed in one forward, default: 4\n"
+        << "\t--tile_max_det\tWith --tile, max number of detections in the whole image, default: 0 (300 per tile)\n"
+        << "\t--full_frame\tWith --tile, also process the whole image downscaled to detect large objects\n"
         << "\t--gpu\tIf set, will try to use the GPU for inference, otherwise use the CPU\n"
         << "\t--simple_ui\tIf set, switch to basic YoloV5 without the machine UI\n"
         << std::endl;
@@ -18,8 +31,18 @@ int main(int argc, char* argv[])
 {
     std::string model = "yolov5s.yaml";
     std::string weights = "yolov5s.pt";
-    std::string path = "";
-    std::string save = "";
+    std::vector<std::string> paths;
+    std::vector<std::string> saves;
+    std::string snapshot = "";
+    std::string compile = "";
+    std::string precision = "fp32";
+    std::string calibration = "";
+    bool int8 = false;
+    bool channels_last = false;
+    bool prepack = false;
+    bool mosaic = false;
+    TilingOptions tiling;
+    int tile_size = 0;
     bool gpu = false;
     bool simple_ui = false;
 
@@ -62,11 +85,155 @@ int main(int argc, char* argv[])
                 return 1;
             }
         }
+        else if (arg == "--snapshot")
+        {
+            if (i + 1 < argc)
+            {
+                snapshot = argv[++i];
+            }
+            else
+            {
+                std::cerr << "--snapshot requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--compile")
+        {
+            if (i + 1 < argc)
+            {
+                compile = argv[++i];
+            }
+            else
+            {
+                std::cerr << "--compile requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--precision")
+        {
+            if (i + 1 < argc)
+            {
+                precision = argv[++i];
+            }
+            else
+            {
+                std::cerr << "--precision requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--calibration")
+        {
+            if (i + 1 < argc)
+            {
+                calibration = argv[++i];
+            }
+            else
+            {
+                std::cerr << "--calibration requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--int8")
+        {
+            int8 = true;
+        }
+        else if (arg == "--channels_last")
+        {
+            channels_last = true;
+        }
+        else if (arg == "--prepack")
+        {
+            prepack = true;
+        }
+        else if (arg == "--tile")
+        {
+            if (i + 1 < argc)
+            {
+                try
+                {
+                    tile_size = std::stoi(argv[++i]);
+                }
+                catch (const std::exception&)
+                {
+                    std::cerr << "--tile requires an integer" << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "--tile requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tile_overlap")
+        {
+            if (i + 1 < argc)
+            {
+                try
+                {
+                    tiling.overlap = std::stoi(argv[++i]);
+                }
+                catch (const std::exception&)
+                {
+                    std::cerr << "--tile_overlap requires an integer" << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "--tile_overlap requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tile_batch")
+        {
+            if (i + 1 < argc)
+            {
+                try
+                {
+                    tiling.batch_size = std::stoi(argv[++i]);
+                }
+                catch (const std::exception&)
+                {
+                    std::cerr << "--tile_batch requires an integer" << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "--tile_batch requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tile_max_det")
+        {
+            if (i + 1 < argc)
+            {
+                try
+                {
+                    tiling.max_det = std::stoi(argv[++i]);
+                }
+                catch (const std::exception&)
+                {
+                    std::cerr << "--tile_max_det requires an integer" << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "--tile_max_det requires an argument" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--full_frame")
+        {
+            tiling.full_frame = true;
+        }
         else if (arg == "--path")
         {
             if (i + 1 < argc)
             {
-                path = argv[++i];
+                paths.push_back(argv[++i]);
             }
             else
             {
@@ -78,7 +245,7 @@ int main(int argc, char* argv[])
         {
             if (i + 1 < argc)
             {
-                save = argv[++i];
+                saves.push_back(argv[++i]);
             }
             else
             {
@@ -86,6 +253,10 @@ int main(int argc, char* argv[])
                 return 1;
             }
         }
+        else if (arg == "--mosaic")
+        {
+            mosaic = true;
+        }
         else if (arg == "--gpu")
         {
             gpu = true;
@@ -96,20 +267,101 @@ int main(int argc, char* argv[])
         }
     }
 
+    torch::Dtype dtype = torch::kFloat;
+    if (precision == "bf16")
+    {
+        dtype = torch::kBFloat16;
+    }
+    else if (precision == "fp16")
+    {
+        dtype = torch::kHalf;
+    }
+    else if (precision != "fp32")
+    {
+        std::cerr << "Unknown precision " << precision << ", should be fp32, bf16 or fp16" << std::endl;
+        return 1;
+    }
+
+    if (compile.empty() && paths.empty())
+    {
+        std::cerr << "--path is required" << std::endl;
+        return 1;
+    }
+
+    if (mosaic && tile_size > 0)
+    {
+        std::cerr << "--mosaic and --tile can't be used together" << std::endl;
+        return 1;
+    }
+
+    if (int8 && (gpu || dtype != torch::kFloat))
+    {
+        std::cerr << "--int8 is only available on CPU with fp32 precision" << std::endl;
+        return 1;
+    }
+
     try
     {
         // Disable gradients
         torch::NoGradGuard no_grad;
 
+        if (!compile.empty())
+        {
+            YoloV5 detector(model, 3);
+            detector->LoadWeights(weights);
+            detector->FuseConvAndBN();
+            detector->SaveSnapshot(compile, dtype);
+            return 0;
+        }
+
         torch::Device device = torch::kCPU;
         if (gpu && torch::cuda::is_available())
         {
             device = torch::kCUDA;
         }
 
-        TheMachine machine(model, weights, 640, device, simple_ui);
+        std::unique_ptr<TheMachine> machine;
+        if (snapshot.empty())
+        {
+            machine = std::unique_ptr<TheMachine>(new TheMachine(model, weights, 640, device, simple_ui, dtype));
+        }
+        else
+        {
+            machine = std::unique_ptr<TheMachine>(new TheMachine(snapshot, 640, device, simple_ui));
+        }
+
+        if (channels_last)
+        {
+            machine->SetChannelsLast(true);
+        }
 
-        machine.Detect(path, save);
+        if (prepack)
+        {
+            machine->SetPrepacked(true);
+        }
+
+        if (tile_size > 0)
+        {
+            tiling.tile_size = tile_size;
+            machine->SetTiling(true, tiling);
+        }
+
+        if (int8)
+        {
+            machine->QuantizeInt8((snapshot.empty() ? weights : snapshot) + ".int8", calibration);
+        }
+
+        if (mosaic)
+        {
+            machine->DetectMosaic(paths, saves);
+        }
+        else
+        {
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                machine->Detect(paths[i], i < saves.size() ? saves[i] : "");
+            }
+        }
     }
     catch (const std::exception& e)
     {
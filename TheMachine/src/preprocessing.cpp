@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <ATen/Parallel.h>
+#include <opencv2/imgcodecs.hpp>
+
+#include "TheMachine/preprocessing.hpp"
+
+namespace
+{
+    /// <summary>
+    /// Source pixels and weight used for one output coordinate,
+    /// same mapping as cv::resize with INTER_LINEAR
+    /// </summary>
+    struct LinearTap
+    {
+        int i0;
+        int i1;
+        float alpha;
+    };
+
+    std::vector<LinearTap> ComputeTaps(const int src_size, const int dst_size)
+    {
+        std::vector<LinearTap> taps(dst_size);
+        const float scale = static_cast<float>(src_size) / dst_size;
+        for (int i = 0; i < dst_size; ++i)
+        {
+            const float s = std::max((i + 0.5f) * scale - 0.5f, 0.0f);
+            const int i0 = std::min(static_cast<int>(s), src_size - 1);
+            taps[i].i0 = i0;
+            taps[i].i1 = std::min(i0 + 1, src_size - 1);
+            taps[i].alpha = i0 == src_size - 1 ? 0.0f : s - i0;
+        }
+        return taps;
+    }
+
+    /// <summary>
+    /// Horizontal pass of one source row into a [resized_width, 3] buffer
+    /// </summary>
+    void ResampleRow(const uint8_t* src_row, const std::vector<LinearTap>& taps, float* out)
+    {
+        for (size_t x = 0; x < taps.size(); ++x)
+        {
+            const uint8_t* p0 = src_row + 3 * taps[x].i0;
+            const uint8_t* p1 = src_row + 3 * taps[x].i1;
+            const float a = taps[x].alpha;
+            for (int c = 0; c < 3; ++c)
+            {
+                out[3 * x + c] = p0[c] + a * (p1[c] - p0[c]);
+            }
+        }
+    }
+
+    template<typename T>
+    T Convert(const float v);
+
+    template<>
+    uint8_t Convert<uint8_t>(const float v)
+    {
+        // Values are already in [0, 255]
+        return static_cast<uint8_t>(v + 0.5f);
+    }
+
+    template<>
+    float Convert<float>(const float v)
+    {
+        return v;
+    }
+
+    template<typename T>
+    void LetterboxImpl(const cv::Mat& src, const LetterboxGeometry& g, torch::Tensor& dst, const bool normalize)
+    {
+        T* dst_ptr = dst.data_ptr<T>();
+        const int64_t stride_c = dst.stride(0);
+        const int64_t stride_h = dst.stride(1);
+        const int64_t stride_w = dst.stride(2);
+
+        // BGR -> RGB and [0, 255] -> [0, 1] if required
+        const float scale = normalize ? 1.0f / 255.0f : 1.0f;
+        int64_t channel_offsets[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            channel_offsets[c] = (normalize ? 2 - c : c) * stride_c;
+        }
+        const T pad_value = Convert<T>(128.0f * scale);
+
+        const std::vector<LinearTap> taps_x = ComputeTaps(src.cols, g.resized_width);
+        const std::vector<LinearTap> taps_y = ComputeTaps(src.rows, g.resized_height);
+
+        at::parallel_for(0, g.height, 16, [&](int64_t begin, int64_t end)
+            {
+                // Horizontally resampled rows, the last
+                // ones are kept as they are often reused
+                std::vector<float> row0(3 * g.resized_width);
+                std::vector<float> row1(3 * g.resized_width);
+                std::vector<float> blended(3 * g.resized_width);
+                int cached0 = -1;
+                int cached1 = -1;
+
+                for (int64_t y = begin; y < end; ++y)
+                {
+                    T* dst_row = dst_ptr + y * stride_h;
+                    const int64_t ry = y - g.pad_y;
+                    if (ry < 0 || ry >= g.resized_height)
+                    {
+                        for (int64_t x = 0; x < g.width; ++x)
+                        {
+                            for (int c = 0; c < 3; ++c)
+                            {
+                                dst_row[x * stride_w + c * stride_c] = pad_value;
+                            }
+                        }
+                        continue;
+                    }
+
+                    const LinearTap& tap = taps_y[ry];
+                    if (cached0 != tap.i0)
+                    {
+                        if (cached1 == tap.i0)
+                        {
+                            std::swap(row0, row1);
+                            std::swap(cached0, cached1);
+                        }
+                        else
+                        {
+                            ResampleRow(src.ptr<uint8_t>(tap.i0), taps_x, row0.data());
+                            cached0 = tap.i0;
+                        }
+                    }
+                    if (tap.alpha != 0.0f && cached1 != tap.i1)
+                    {
+                        ResampleRow(src.ptr<uint8_t>(tap.i1), taps_x, row1.data());
+                        cached1 = tap.i1;
+                    }
+
+                    // Vertical pass, contiguous so it's vectorized
+                    const float a = tap.alpha;
+                    const float* r0 = row0.data();
+                    const float* r1 = row1.data();
+                    float* b = blended.data();
+                    if (a == 0.0f)
+                    {
+                        for (int i = 0; i < 3 * g.resized_width; ++i)
+                        {
+                            b[i] = r0[i] * scale;
+                        }
+                    }
+                    else
+                    {
+                        for (int i = 0; i < 3 * g.resized_width; ++i)
+                        {
+                            b[i] = (r0[i] + a * (r1[i] - r0[i])) * scale;
+                        }
+                    }
+
+                    for (int64_t x = 0; x < g.width; ++x)
+                    {
+                        const int64_t rx = x - g.pad_x;
+                        T* dst_pixel = dst_row + x * stride_w;
+                        if (rx < 0 || rx >= g.resized_width)
+                        {
+                            for (int c = 0; c < 3; ++c)
+                            {
+                                dst_pixel[c * stride_c] = pad_value;
+                            }
+                            continue;
+                        }
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            dst_pixel[channel_offsets[c]] = Convert<T>(b[3 * rx + c]);
+                        }
+                    }
+                }
+            });
+    }
+}
+
+bool ReadJpegSize(const std::string& path, int& width, int& height)
+{
+    std::ifstream file(path, std::ios::binary);
+    unsigned char buffer[5];
+
+    // SOI marker
+    if (!file.read(reinterpret_cast<char*>(buffer), 2) || buffer[0] != 0xFF || buffer[1] != 0xD8)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        if (file.get() != 0xFF)
+        {
+            return false;
+        }
+        // Markers can be preceded by any number of fill bytes
+        int marker = file.get();
+        while (marker == 0xFF)
+        {
+            marker = file.get();
+        }
+        if (marker == std::char_traits<char>::eof())
+        {
+            return false;
+        }
+        // Standalone markers without any segment
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            continue;
+        }
+        // Start of scan or end of image before any frame header
+        if (marker == 0xDA || marker == 0xD9)
+        {
+            return false;
+        }
+
+        if (!file.read(reinterpret_cast<char*>(buffer), 2))
+        {
+            return false;
+        }
+        const int length = (buffer[0] << 8) | buffer[1];
+        if (length < 2)
+        {
+            return false;
+        }
+
+        // Start of frame, except DHT (C4), JPG (C8) and DAC (CC) in the same range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            // Sample precision, then height and width
+            if (length < 7 || !file.read(reinterpret_cast<char*>(buffer), 5))
+            {
+                return false;
+            }
+            height = (buffer[1] << 8) | buffer[2];
+            width = (buffer[3] << 8) | buffer[4];
+            return width > 0 && height > 0;
+        }
+
+        file.seekg(length - 2, std::ios::cur);
+    }
+}
+
+cv::Mat LoadImage(const std::string& path, const int process_size, int& width, int& height)
+{
+    int reduction = 1;
+    if (process_size > 0 && ReadJpegSize(path, width, height))
+    {
+        // Largest reduction that doesn't make the
+        // decoded image smaller than the resized one
+        const float ratio = std::min(static_cast<float>(process_size) / height, static_cast<float>(process_size) / width);
+        for (const int r : { 8, 4, 2 })
+        {
+            if (r * ratio <= 1.0f)
+            {
+                reduction = r;
+                break;
+            }
+        }
+    }
+
+    int flags = cv::IMREAD_COLOR;
+    switch (reduction)
+    {
+    case 2:
+        flags = cv::IMREAD_REDUCED_COLOR_2;
+        break;
+    case 4:
+        flags = cv::IMREAD_REDUCED_COLOR_4;
+        break;
+    case 8:
+        flags = cv::IMREAD_REDUCED_COLOR_8;
+        break;
+    default:
+        break;
+    }
+
+    cv::Mat img = cv::imread(path, flags);
+    if (img.empty())
+    {
+        throw std::runtime_error("Can't read image " + path);
+    }
+
+    if (reduction == 1)
+    {
+        width = img.cols;
+        height = img.rows;
+    }
+    // EXIF orientation is applied after decoding,
+    // the frame header has the size before rotation
+    else if (width != height && (width > height) != (img.cols > img.rows))
+    {
+        std::swap(width, height);
+    }
+
+    return img;
+}
+
+LetterboxGeometry ComputeLetterbox(const int src_width, const int src_height, const int process_size, const int stride)
+{
+    LetterboxGeometry g;
+    g.ratio = std::min(static_cast<float>(process_size) / src_height, static_cast<float>(process_size) / src_width);
+
+    g.resized_height = std::round(src_height * g.ratio);
+    g.resized_width = std::round(src_width * g.ratio);
+
+    // Pad the smallest side to the next multiple of stride, evenly on both sides
+    const int missing_w = (stride - g.resized_width % stride) % stride;
+    const int missing_h = (stride - g.resized_height % stride) % stride;
+
+    g.pad_x = missing_w / 2;
+    g.pad_y = missing_h / 2;
+    g.width = g.resized_width + missing_w;
+    g.height = g.resized_height + missing_h;
+
+    return g;
+}
+
+std::vector<int> ComputeTileStarts(const int size, const int tile_size, const int overlap)
+{
+    const int step = tile_size - overlap;
+    if (step <= 0)
+    {
+        throw std::runtime_error("Tile overlap must be smaller than tile size");
+    }
+
+    std::vector<int> starts;
+    for (int s = 0; ; s += step)
+    {
+        if (s + tile_size >= size)
+        {
+            starts.push_back(std::max(0, size - tile_size));
+            break;
+        }
+        starts.push_back(s);
+    }
+
+    return starts;
+}
+
+std::vector<MosaicPlacement> PackMosaic(const std::vector<cv::Size>& sizes,
+    const int canvas_width, const int canvas_height, const int guard)
+{
+    // Highest images first, so the shelves are well filled
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
+        {
+            return sizes[a].height > sizes[b].height;
+        });
+
+    std::vector<MosaicPlacement> placements(sizes.size());
+    int canvas = 0;
+    int shelf_y = 0;
+    int shelf_height = 0;
+    int x = 0;
+    for (const size_t i : order)
+    {
+        const cv::Size& size = sizes[i];
+        if (size.width > canvas_width || size.height > canvas_height)
+        {
+            throw std::runtime_error("Image too large for the mosaic canvas");
+        }
+
+        // Start a new shelf if the current one is full
+        if (x > 0 && x + size.width > canvas_width)
+        {
+            shelf_y += shelf_height + guard;
+            shelf_height = 0;
+            x = 0;
+        }
+        // Start a new canvas if the new shelf doesn't fit
+        if (shelf_y > 0 && shelf_y + size.height > canvas_height)
+        {
+            canvas += 1;
+            shelf_y = 0;
+            shelf_height = 0;
+            x = 0;
+        }
+
+        placements[i] = MosaicPlacement{ canvas, cv::Rect(x, shelf_y, size.width, size.height) };
+        x += size.width + guard;
+        shelf_height = std::max(shelf_height, size.height);
+    }
+
+    return placements;
+}
+
+void Letterbox(const cv::Mat& src, const LetterboxGeometry& geometry, torch::Tensor dst, const bool normalize)
+{
+    if (src.type() != CV_8UC3)
+    {
+        throw std::runtime_error("Letterbox requires a 3 channels uint8 image");
+    }
+    if (dst.dim() != 3 || dst.size(0) != 3 || dst.size(1) != geometry.height || dst.size(2) != geometry.width || !dst.device().is_cpu())
+    {
+        throw std::runtime_error("Wrong letterbox destination tensor");
+    }
+
+    if (dst.scalar_type() == torch::kByte && !normalize)
+    {
+        LetterboxImpl<uint8_t>(src, geometry, dst, normalize);
+    }
+    else if (dst.scalar_type() == torch::kFloat)
+    {
+        LetterboxImpl<float>(src, geometry, dst, normalize);
+    }
+    else
+    {
+        throw std::runtime_error("Letterbox destination must be kFloat, or kByte without normalization");
+    }
+}
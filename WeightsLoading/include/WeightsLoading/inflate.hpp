@@ -0,0 +1,23 @@
+#pragma once
+
+#include <functional>
+
+/// <summary>
+/// Size of the chunks given to the Inflate callback
+/// </summary>
+constexpr size_t inflate_chunk_size = 1 << 15;
+
+/// <summary>
+/// Decompress raw DEFLATE data (RFC 1951, compression method 8
+/// of zip archives). Output is never stored entirely, only the
+/// last 32KB needed for back references are kept and given to
+/// the callback as soon as they are ready. All chunks but the
+/// last one are exactly inflate_chunk_size bytes long.
+/// </summary>
+/// <param name="src">Compressed data</param>
+/// <param name="src_size">Size of the compressed data</param>
+/// <param name="max_output">Decompression stops after this number of bytes</param>
+/// <param name="callback">Called with each decompressed chunk, in order</param>
+/// <returns>Number of decompressed bytes</returns>
+size_t Inflate(const char* src, const size_t src_size, const size_t max_output,
+	const std::function<void(const char*, const size_t)>& callback);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+/// <summary>
+/// A read-only mapping of a whole file in memory.
+/// Pages are loaded lazily by the OS when accessed
+/// and are shared with any other mapping of the
+/// same file, in this process or in another one.
+/// </summary>
+class MemoryMappedFile
+{
+public:
+	MemoryMappedFile(const std::string& path);
+	~MemoryMappedFile();
+
+	MemoryMappedFile() = delete;
+	MemoryMappedFile(const MemoryMappedFile&) = delete;
+	MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+	/// <summary>
+	/// Pointer to the beginning of the file. Memory is
+	/// read-only, writing to it will crash the program.
+	/// </summary>
+	const char* Data() const;
+	size_t Size() const;
+
+private:
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#else
+	int file_descriptor;
+#endif
+};
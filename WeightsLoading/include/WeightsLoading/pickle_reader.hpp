@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Type of the storage backing a tensor in a .pt file
+/// </summary>
+enum class StorageType
+{
+	Float,
+	Double,
+	Half,
+	BFloat16,
+	Long,
+	Int,
+	Short,
+	Char,
+	Byte,
+	Bool,
+	Unknown
+};
+
+/// <summary>
+/// Size in bytes of one element of the given storage type (0 if unknown)
+/// </summary>
+size_t StorageElementSize(const StorageType type);
+
+/// <summary>
+/// Description of a tensor saved in a .pt file
+/// </summary>
+struct TensorInfo
+{
+	StorageType type;
+	// Name of the file containing the storage in the data/ folder of the archive
+	std::string storage_key;
+	// Offset in the storage, in number of elements
+	int64_t storage_offset;
+	std::vector<int64_t> shape;
+	std::vector<int64_t> stride;
+
+	int64_t Numel() const;
+	bool IsContiguous() const;
+};
+
+/// <summary>
+/// Minimal unpickler for the data.pkl file of torch.save archives.
+/// It doesn't create any python object, it only follows dicts,
+/// objects states, lists and tuples to find the tensors and give
+/// them a name. Keys of _modules, _parameters and _buffers are
+/// skipped so names look like the ones of a python state_dict
+/// (e.g. model.model.0.conv.weight for a YoloV5 checkpoint).
+/// </summary>
+/// <param name="data">Content of data.pkl</param>
+/// <param name="size">Size of data.pkl</param>
+/// <returns>All the tensors found, in pickle order</returns>
+std::vector<std::pair<std::string, TensorInfo> > ReadPickledTensors(const char* data, const size_t size);
@@ -3,16 +3,39 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "WeightsLoading/memory_mapped_file.hpp"
+#include "WeightsLoading/pickle_reader.hpp"
+
+/// <summary>
+/// A non-owning view on raw bytes of a tensor
+/// </summary>
+struct RawTensorData
+{
+	const char* data;
+	size_t size;
+};
 
 /// <summary>
 /// A simple class to load python .pt files into a C++ module with
 /// the same architecture. This is NOT a full zip implementation
-/// but it gets the job done.
+/// but it gets the job done. Entries can be stored or compressed
+/// with DEFLATE.
 /// </summary>
 class PythonWeightsFile
 {
 public:
-    PythonWeightsFile(const std::string& path);
+	/// <summary>
+	/// Open a .pt file
+	/// </summary>
+	/// <param name="path">Path to the file</param>
+	/// <param name="memory_mapped">If true, the file is mapped in memory
+	/// and tensor data are returned without any copy</param>
+    PythonWeightsFile(const std::string& path, const bool memory_mapped = false);
     ~PythonWeightsFile();
 
     PythonWeightsFile() = delete;
@@ -26,10 +49,74 @@ public:
 	/// <returns>Raw tensor bytes</returns>
 	std::vector<char> GetNextTensor();
 
+	/// <summary>
+	/// Same as GetNextTensor, but without copy if the
+	/// file is memory mapped. Otherwise, the data are
+	/// read in an internal buffer and the view is only
+	/// valid until the next call. Throws an error if
+	/// the entry is compressed.
+	/// </summary>
+	/// <returns>A view on raw tensor bytes</returns>
+	RawTensorData GetNextTensorView();
+
+	/// <summary>
+	/// Describe the whole storage of the next tensor file
+	/// as a 1D tensor, so it can be read with ReadTensor
+	/// </summary>
+	/// <param name="type">Type of the data in the storage</param>
+	/// <returns>The tensor description</returns>
+	TensorInfo GetNextTensorInfo(const StorageType type);
+
+	/// <summary>
+	/// Get all the tensors described in data.pkl, with
+	/// their name, type and shape, in pickle order.
+	/// Empty if data.pkl can't be read.
+	/// </summary>
+	const std::vector<std::pair<std::string, TensorInfo> >& GetTensorInfos() const;
+
+	/// <summary>
+	/// Search a tensor described in data.pkl by name
+	/// </summary>
+	/// <param name="name">Name of the tensor (e.g. model.model.0.conv.weight)</param>
+	/// <returns>A pointer to the tensor description, nullptr if not found</returns>
+	const TensorInfo* FindTensor(const std::string& name) const;
+
+	/// <summary>
+	/// Get the raw bytes of a tensor described in data.pkl.
+	/// Same lifetime rules as GetNextTensorView.
+	/// </summary>
+	/// <param name="tensor">Tensor description, must be contiguous</param>
+	/// <returns>A view on raw tensor bytes</returns>
+	RawTensorData GetTensorView(const TensorInfo& tensor);
+
+	/// <summary>
+	/// Check if the storage of a tensor is compressed,
+	/// in which case GetTensorView can't be used
+	/// </summary>
+	bool IsCompressed(const TensorInfo& tensor) const;
+
+	/// <summary>
+	/// Read the raw bytes of a tensor by chunks, decompressing
+	/// them on the fly if needed so the whole entry is never
+	/// stored in memory. Offsets of the chunks are always a
+	/// multiple of the element size. Can be called from
+	/// multiple threads at the same time.
+	/// </summary>
+	/// <param name="tensor">Tensor description, must be contiguous</param>
+	/// <param name="callback">Called with each chunk data, its offset
+	/// from the beginning of the tensor and its size, in bytes</param>
+	void ReadTensor(const TensorInfo& tensor,
+		const std::function<void(const char*, const size_t, const size_t)>& callback);
+
 private:
 	void ReadHeaders();
+	void Read(const std::streamoff offset, const size_t size, char* dst);
 	std::vector<char> GetData(const size_t index);
+	RawTensorData GetDataView(const size_t index);
 	void ReadTensorOrder();
+	void ReadTensorInfos();
+	size_t NextTensorEntry();
+	size_t GetTensorEntry(const TensorInfo& tensor, size_t& offset, size_t& size) const;
 
 	/// <summary>
 	/// Nested class to keep track of all "files" in the given zip archive
@@ -46,8 +133,19 @@ private:
 
 private:
 	std::ifstream file;
+	// Protect file reads when not memory mapped
+	std::mutex file_mutex;
+	std::unique_ptr<MemoryMappedFile> mapped_file;
+	std::streamoff file_size;
+	std::vector<char> buffer;
 	std::vector<ZipEntry> entries;
+	// Root folder of the archive, with a trailing /
+	std::string archive_prefix;
+	// Storage key --> index in entries
+	std::map<std::string, size_t> storage_entries;
+	std::vector<std::pair<std::string, TensorInfo> > tensor_infos;
+	// Tensor name --> index in tensor_infos
+	std::map<std::string, size_t> tensor_names;
 	std::vector<size_t> tensor_order;
 	int next_tensor_index;
 };
-
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "WeightsLoading/inflate.hpp"
+
+namespace
+{
+	// Base values and number of extra bits for length
+	// codes 257..285 and distance codes 0..29 (RFC 1951 3.2.5)
+	const uint16_t length_base[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t length_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t distance_base[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577 };
+	const uint8_t distance_extra[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	// Order of the code length code lengths in dynamic blocks
+	const uint8_t code_length_order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	const int max_code_length = 15;
+	const int fast_bits = 10;
+
+	// Back references can't go further than 32KB, so
+	// a 64KB ring buffer lets us give the previous
+	// 32KB to the callback while writing the next ones
+	const size_t window_size = 2 * inflate_chunk_size;
+	const size_t window_mask = window_size - 1;
+
+	/// <summary>
+	/// Canonical Huffman code, decoded with a lookup table
+	/// for short codes and bit by bit for the longer ones
+	/// </summary>
+	struct Huffman
+	{
+		uint16_t count[max_code_length + 1];
+		uint16_t symbol[288];
+		// (symbol << 4) | length, 0 if the code is longer than fast_bits
+		uint16_t fast[1 << fast_bits];
+
+		void Build(const uint8_t* lengths, const int num_symbols)
+		{
+			std::memset(count, 0, sizeof(count));
+			std::memset(fast, 0, sizeof(fast));
+			for (int i = 0; i < num_symbols; ++i)
+			{
+				count[lengths[i]] += 1;
+			}
+			count[0] = 0;
+
+			// Check the code is not over-subscribed
+			int left = 1;
+			uint16_t offsets[max_code_length + 2];
+			offsets[1] = 0;
+			for (int len = 1; len <= max_code_length; ++len)
+			{
+				left <<= 1;
+				left -= count[len];
+				if (left < 0)
+				{
+					throw std::runtime_error("Invalid Huffman code in deflate stream");
+				}
+				offsets[len + 1] = offsets[len] + count[len];
+			}
+
+			// Symbols sorted by code, codes of the same length
+			// are consecutive and in symbol order
+			uint16_t next_code[max_code_length + 1];
+			int code = 0;
+			for (int len = 1; len <= max_code_length; ++len)
+			{
+				code = (code + count[len - 1]) << 1;
+				next_code[len] = code;
+			}
+			for (int i = 0; i < num_symbols; ++i)
+			{
+				const int len = lengths[i];
+				if (len == 0)
+				{
+					continue;
+				}
+				symbol[offsets[len]++] = i;
+
+				if (len <= fast_bits)
+				{
+					// Codes are packed starting with their most significant
+					// bit, but the bit reader gives the first bit as the lowest
+					int reversed = 0;
+					int c = next_code[len];
+					for (int b = 0; b < len; ++b)
+					{
+						reversed = (reversed << 1) | (c & 1);
+						c >>= 1;
+					}
+					for (int fill = reversed; fill < (1 << fast_bits); fill += 1 << len)
+					{
+						fast[fill] = static_cast<uint16_t>((i << 4) | len);
+					}
+				}
+				next_code[len] += 1;
+			}
+		}
+	};
+
+	class Inflater
+	{
+	public:
+		Inflater(const char* src_, const size_t src_size_, const size_t max_output_,
+			const std::function<void(const char*, const size_t)>& callback_) :
+			src(reinterpret_cast<const uint8_t*>(src_)), src_size(src_size_), src_pos(0),
+			bit_buffer(0), bit_count(0), padding_bits(0),
+			window(window_size), output_size(0), flushed_size(0),
+			max_output(max_output_), callback(callback_)
+		{
+		}
+
+		size_t Run()
+		{
+			bool last_block = false;
+			while (!last_block && output_size < max_output)
+			{
+				last_block = GetBits(1) == 1;
+				switch (GetBits(2))
+				{
+				case 0:
+					StoredBlock();
+					break;
+				case 1:
+					FixedBlock();
+					break;
+				case 2:
+					DynamicBlock();
+					break;
+				default:
+					throw std::runtime_error("Invalid block type in deflate stream");
+				}
+			}
+			Flush();
+			return flushed_size;
+		}
+
+	private:
+		void Refill()
+		{
+			while (bit_count <= 56)
+			{
+				uint64_t byte = 0;
+				if (src_pos < src_size)
+				{
+					byte = src[src_pos];
+				}
+				else
+				{
+					// Pad with zeros, it's an error only
+					// if these bits are actually consumed
+					padding_bits += 8;
+				}
+				src_pos += 1;
+				bit_buffer |= byte << bit_count;
+				bit_count += 8;
+			}
+		}
+
+		void Consume(const int n)
+		{
+			bit_buffer >>= n;
+			bit_count -= n;
+			if (padding_bits > bit_count)
+			{
+				throw std::runtime_error("Unexpected end of deflate stream");
+			}
+		}
+
+		uint32_t GetBits(const int n)
+		{
+			if (n == 0)
+			{
+				return 0;
+			}
+			if (bit_count < n)
+			{
+				Refill();
+			}
+			const uint32_t output = static_cast<uint32_t>(bit_buffer & ((uint64_t(1) << n) - 1));
+			Consume(n);
+			return output;
+		}
+
+		int Decode(const Huffman& h)
+		{
+			if (bit_count < max_code_length)
+			{
+				Refill();
+			}
+
+			const uint16_t entry = h.fast[bit_buffer & ((1 << fast_bits) - 1)];
+			if (entry != 0)
+			{
+				Consume(entry & 0xF);
+				return entry >> 4;
+			}
+
+			// Slow path for long codes, walk the canonical code one bit at a time
+			int code = 0;
+			int first = 0;
+			int index = 0;
+			for (int len = 1; len <= max_code_length; ++len)
+			{
+				code |= (bit_buffer >> (len - 1)) & 1;
+				const int count = h.count[len];
+				if (code - first < count)
+				{
+					Consume(len);
+					return h.symbol[index + code - first];
+				}
+				index += count;
+				first = (first + count) << 1;
+				code <<= 1;
+			}
+			throw std::runtime_error("Invalid Huffman code in deflate stream");
+		}
+
+		void Put(const uint8_t byte)
+		{
+			window[output_size & window_mask] = byte;
+			output_size += 1;
+			if ((output_size & (inflate_chunk_size - 1)) == 0)
+			{
+				Flush();
+			}
+		}
+
+		void Flush()
+		{
+			const size_t end = std::min(output_size, max_output);
+			if (end > flushed_size)
+			{
+				callback(reinterpret_cast<const char*>(window.data()) + (flushed_size & window_mask), end - flushed_size);
+				flushed_size = end;
+			}
+		}
+
+		void StoredBlock()
+		{
+			// Skip the remaining bits of the current byte
+			Consume(bit_count & 7);
+			const uint32_t length = GetBits(16);
+			const uint32_t nlength = GetBits(16);
+			if (length != (~nlength & 0xFFFF))
+			{
+				throw std::runtime_error("Corrupted stored block in deflate stream");
+			}
+
+			uint32_t remaining = length;
+			// Bytes already in the bit buffer
+			while (remaining > 0 && bit_count > 0 && output_size < max_output)
+			{
+				Put(static_cast<uint8_t>(GetBits(8)));
+				remaining -= 1;
+			}
+			if (bit_count == 0)
+			{
+				bit_buffer = 0;
+			}
+
+			// Then directly from the source
+			while (remaining > 0 && output_size < max_output)
+			{
+				if (src_pos >= src_size)
+				{
+					throw std::runtime_error("Unexpected end of deflate stream");
+				}
+				const size_t n = std::min<size_t>({ remaining, src_size - src_pos,
+					inflate_chunk_size - (output_size & (inflate_chunk_size - 1)) });
+				std::memcpy(window.data() + (output_size & window_mask), src + src_pos, n);
+				src_pos += n;
+				remaining -= static_cast<uint32_t>(n);
+				output_size += n;
+				if ((output_size & (inflate_chunk_size - 1)) == 0)
+				{
+					Flush();
+				}
+			}
+		}
+
+		void FixedBlock()
+		{
+			if (!fixed_built)
+			{
+				uint8_t lengths[288 + 30];
+				std::memset(lengths, 8, 144);
+				std::memset(lengths + 144, 9, 112);
+				std::memset(lengths + 256, 7, 24);
+				std::memset(lengths + 280, 8, 8);
+				std::memset(lengths + 288, 5, 30);
+				fixed_literals.Build(lengths, 288);
+				fixed_distances.Build(lengths + 288, 30);
+				fixed_built = true;
+			}
+			Codes(fixed_literals, fixed_distances);
+		}
+
+		void DynamicBlock()
+		{
+			const int num_literals = GetBits(5) + 257;
+			const int num_distances = GetBits(5) + 1;
+			const int num_code_lengths = GetBits(4) + 4;
+			if (num_literals > 286 || num_distances > 30)
+			{
+				throw std::runtime_error("Too many codes in deflate dynamic block");
+			}
+
+			uint8_t lengths[286 + 30];
+			std::memset(lengths, 0, 19);
+			for (int i = 0; i < num_code_lengths; ++i)
+			{
+				lengths[code_length_order[i]] = GetBits(3);
+			}
+			Huffman code_lengths;
+			code_lengths.Build(lengths, 19);
+
+			int index = 0;
+			while (index < num_literals + num_distances)
+			{
+				const int symbol = Decode(code_lengths);
+				if (symbol < 16)
+				{
+					lengths[index++] = symbol;
+					continue;
+				}
+
+				uint8_t value = 0;
+				int repeat = 0;
+				if (symbol == 16)
+				{
+					if (index == 0)
+					{
+						throw std::runtime_error("Invalid code lengths in deflate dynamic block");
+					}
+					value = lengths[index - 1];
+					repeat = 3 + GetBits(2);
+				}
+				else if (symbol == 17)
+				{
+					repeat = 3 + GetBits(3);
+				}
+				else
+				{
+					repeat = 11 + GetBits(7);
+				}
+				if (index + repeat > num_literals + num_distances)
+				{
+					throw std::runtime_error("Invalid code lengths in deflate dynamic block");
+				}
+				std::memset(lengths + index, value, repeat);
+				index += repeat;
+			}
+
+			if (lengths[256] == 0)
+			{
+				throw std::runtime_error("Missing end of block code in deflate dynamic block");
+			}
+
+			literals.Build(lengths, num_literals);
+			distances.Build(lengths + num_literals, num_distances);
+			Codes(literals, distances);
+		}
+
+		void Codes(const Huffman& literal_code, const Huffman& distance_code)
+		{
+			while (output_size < max_output)
+			{
+				const int symbol = Decode(literal_code);
+				if (symbol < 256)
+				{
+					Put(static_cast<uint8_t>(symbol));
+					continue;
+				}
+				if (symbol == 256)
+				{
+					return;
+				}
+				if (symbol > 285)
+				{
+					throw std::runtime_error("Invalid length code in deflate stream");
+				}
+
+				const size_t length = length_base[symbol - 257] + GetBits(length_extra[symbol - 257]);
+				const int distance_symbol = Decode(distance_code);
+				if (distance_symbol > 29)
+				{
+					throw std::runtime_error("Invalid distance code in deflate stream");
+				}
+				const size_t distance = distance_base[distance_symbol] + GetBits(distance_extra[distance_symbol]);
+				if (distance > output_size)
+				{
+					throw std::runtime_error("Invalid back reference in deflate stream");
+				}
+
+				for (size_t i = 0; i < length; ++i)
+				{
+					Put(window[(output_size - distance) & window_mask]);
+				}
+			}
+		}
+
+	private:
+		const uint8_t* src;
+		size_t src_size;
+		size_t src_pos;
+		uint64_t bit_buffer;
+		int bit_count;
+		int padding_bits;
+
+		std::vector<uint8_t> window;
+		size_t output_size;
+		size_t flushed_size;
+		size_t max_output;
+		const std::function<void(const char*, const size_t)>& callback;
+
+		Huffman literals;
+		Huffman distances;
+		bool fixed_built = false;
+		Huffman fixed_literals;
+		Huffman fixed_distances;
+	};
+}
+
+size_t Inflate(const char* src, const size_t src_size, const size_t max_output,
+	const std::function<void(const char*, const size_t)>& callback)
+{
+	Inflater inflater(src, src_size, max_output, callback);
+	return inflater.Run();
+}
@@ -0,0 +1,126 @@
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdexcept>
+
+#include "WeightsLoading/memory_mapped_file.hpp"
+
+#ifdef _WIN32
+MemoryMappedFile::MemoryMappedFile(const std::string& path)
+{
+	data = nullptr;
+	size = 0;
+	mapping_handle = nullptr;
+
+	file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("Can't open file " + path);
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size))
+	{
+		CloseHandle(file_handle);
+		throw std::runtime_error("Can't get size of file " + path);
+	}
+	size = static_cast<size_t>(file_size.QuadPart);
+
+	// Can't map an empty file, but it's not an error either
+	if (size == 0)
+	{
+		return;
+	}
+
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_handle == nullptr)
+	{
+		CloseHandle(file_handle);
+		throw std::runtime_error("Can't create file mapping for " + path);
+	}
+
+	data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if (data == nullptr)
+	{
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		throw std::runtime_error("Can't map file " + path);
+	}
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping_handle != nullptr)
+	{
+		CloseHandle(mapping_handle);
+	}
+	CloseHandle(file_handle);
+}
+#else
+MemoryMappedFile::MemoryMappedFile(const std::string& path)
+{
+	data = nullptr;
+	size = 0;
+
+	file_descriptor = open(path.c_str(), O_RDONLY);
+	if (file_descriptor == -1)
+	{
+		throw std::runtime_error("Can't open file " + path);
+	}
+
+	struct stat file_stat;
+	if (fstat(file_descriptor, &file_stat) == -1)
+	{
+		close(file_descriptor);
+		throw std::runtime_error("Can't get size of file " + path);
+	}
+	size = static_cast<size_t>(file_stat.st_size);
+
+	// Can't map an empty file, but it's not an error either
+	if (size == 0)
+	{
+		return;
+	}
+
+	void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+	if (ptr == MAP_FAILED)
+	{
+		close(file_descriptor);
+		throw std::runtime_error("Can't map file " + path);
+	}
+	data = static_cast<const char*>(ptr);
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+	if (data != nullptr)
+	{
+		munmap(const_cast<char*>(data), size);
+	}
+	close(file_descriptor);
+}
+#endif
+
+const char* MemoryMappedFile::Data() const
+{
+	return data;
+}
+
+size_t MemoryMappedFile::Size() const
+{
+	return size;
+}
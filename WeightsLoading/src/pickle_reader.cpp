@@ -0,0 +1,758 @@
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+
+#include "WeightsLoading/pickle_reader.hpp"
+
+size_t StorageElementSize(const StorageType type)
+{
+	switch (type)
+	{
+	case StorageType::Double:
+	case StorageType::Long:
+		return 8;
+	case StorageType::Float:
+	case StorageType::Int:
+		return 4;
+	case StorageType::Half:
+	case StorageType::BFloat16:
+	case StorageType::Short:
+		return 2;
+	case StorageType::Char:
+	case StorageType::Byte:
+	case StorageType::Bool:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int64_t TensorInfo::Numel() const
+{
+	int64_t numel = 1;
+	for (const int64_t s : shape)
+	{
+		numel *= s;
+	}
+	return numel;
+}
+
+bool TensorInfo::IsContiguous() const
+{
+	if (stride.size() != shape.size())
+	{
+		return false;
+	}
+
+	int64_t expected_stride = 1;
+	for (int i = static_cast<int>(shape.size()) - 1; i >= 0; --i)
+	{
+		if (shape[i] != 1 && stride[i] != expected_stride)
+		{
+			return false;
+		}
+		expected_stride *= shape[i];
+	}
+	return true;
+}
+
+/// <summary>
+/// A python object, as much as we need to know about it
+/// </summary>
+struct PickleObject
+{
+	enum class Kind
+	{
+		None,
+		Bool,
+		Int,
+		Float,
+		String,
+		Bytes,
+		Tuple,
+		List,
+		Dict,
+		Set,
+		Global,
+		Object,
+		Storage,
+		Tensor
+	};
+
+	PickleObject(const Kind kind_) : kind(kind_), int_value(0), float_value(0.0)
+	{
+	}
+
+	Kind kind;
+	int64_t int_value;
+	double float_value;
+	// Value for String and Bytes, module for Global
+	std::string str;
+	// Name for Global
+	std::string name;
+	// Elements of Tuple, List and Set, keys and values alternated for Dict
+	std::vector<std::shared_ptr<PickleObject> > items;
+	// Class or function used to create an Object, its arguments and its state
+	std::shared_ptr<PickleObject> callable;
+	std::shared_ptr<PickleObject> args;
+	std::shared_ptr<PickleObject> state;
+	// Storage and Tensor
+	TensorInfo tensor;
+};
+
+typedef std::shared_ptr<PickleObject> PickleObjectPtr;
+
+/// <summary>
+/// Stack machine reading pickle opcodes, see python Lib/pickletools.py
+/// </summary>
+class Unpickler
+{
+public:
+	Unpickler(const char* data_, const size_t size_) : data(data_), size(size_), pos(0)
+	{
+	}
+
+	PickleObjectPtr Load();
+
+private:
+	template<typename T>
+	T Read()
+	{
+		if (pos + sizeof(T) > size)
+		{
+			throw std::runtime_error("Unexpected end of pickle data");
+		}
+		T output;
+		std::memcpy(&output, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return output;
+	}
+
+	std::string ReadBytes(const uint64_t n)
+	{
+		if (n > size - pos)
+		{
+			throw std::runtime_error("Unexpected end of pickle data");
+		}
+		std::string output(data + pos, n);
+		pos += n;
+		return output;
+	}
+
+	std::string ReadLine()
+	{
+		const char* end = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+		if (end == nullptr)
+		{
+			throw std::runtime_error("Unexpected end of pickle data");
+		}
+		std::string output(data + pos, end - data - pos);
+		pos = end - data + 1;
+		return output;
+	}
+
+	PickleObjectPtr Top()
+	{
+		if (stack.empty())
+		{
+			throw std::runtime_error("Empty stack while reading pickle data");
+		}
+		return stack.back();
+	}
+
+	PickleObjectPtr Pop()
+	{
+		PickleObjectPtr output = Top();
+		stack.pop_back();
+		return output;
+	}
+
+	std::vector<PickleObjectPtr> PopMark()
+	{
+		if (marks.empty() || marks.back() > stack.size())
+		{
+			throw std::runtime_error("Missing mark while reading pickle data");
+		}
+		std::vector<PickleObjectPtr> output(stack.begin() + marks.back(), stack.end());
+		stack.resize(marks.back());
+		marks.pop_back();
+		return output;
+	}
+
+	PickleObjectPtr MakeCollection(const PickleObject::Kind kind, const std::vector<PickleObjectPtr>& items)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(kind);
+		output->items = items;
+		return output;
+	}
+
+	PickleObjectPtr MakeInt(const int64_t value)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Int);
+		output->int_value = value;
+		return output;
+	}
+
+	PickleObjectPtr MakeString(const PickleObject::Kind kind, const std::string& value)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(kind);
+		output->str = value;
+		return output;
+	}
+
+	PickleObjectPtr MakeGlobal(const std::string& module, const std::string& name)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Global);
+		output->str = module;
+		output->name = name;
+		return output;
+	}
+
+	PickleObjectPtr MakeObject(const PickleObjectPtr& callable, const PickleObjectPtr& args)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Object);
+		output->callable = callable;
+		output->args = args;
+		return output;
+	}
+
+	int64_t ReadLong(const uint64_t n);
+	PickleObjectPtr Call(const PickleObjectPtr& callable, const PickleObjectPtr& args);
+	PickleObjectPtr PersistentLoad(const PickleObjectPtr& pid);
+	void Build(const PickleObjectPtr& obj, const PickleObjectPtr& state);
+
+private:
+	const char* data;
+	size_t size;
+	size_t pos;
+
+	std::vector<PickleObjectPtr> stack;
+	std::vector<size_t> marks;
+	std::map<uint64_t, PickleObjectPtr> memo;
+};
+
+int64_t Unpickler::ReadLong(const uint64_t n)
+{
+	const std::string bytes = ReadBytes(n);
+	if (n > 8)
+	{
+		throw std::runtime_error("Integer too large in pickle data");
+	}
+
+	// Little-endian two's complement
+	uint64_t value = 0;
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		value |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+	}
+	if (n > 0 && n < 8 && (bytes[n - 1] & 0x80))
+	{
+		value |= ~0ULL << (8 * n);
+	}
+	return static_cast<int64_t>(value);
+}
+
+PickleObjectPtr Unpickler::Call(const PickleObjectPtr& callable, const PickleObjectPtr& args)
+{
+	if (callable->kind != PickleObject::Kind::Global)
+	{
+		return MakeObject(callable, args);
+	}
+
+	const std::string function = callable->str + "." + callable->name;
+	const std::vector<PickleObjectPtr>& a = args->items;
+
+	// _rebuild_tensor_v2(storage, storage_offset, size, stride, ...)
+	if ((function == "torch._utils._rebuild_tensor_v2" || function == "torch._utils._rebuild_tensor")
+		&& a.size() >= 4 && a[0]->kind == PickleObject::Kind::Storage)
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Tensor);
+		output->tensor = a[0]->tensor;
+		output->tensor.storage_offset = a[1]->int_value;
+		for (const PickleObjectPtr& s : a[2]->items)
+		{
+			output->tensor.shape.push_back(s->int_value);
+		}
+		for (const PickleObjectPtr& s : a[3]->items)
+		{
+			output->tensor.stride.push_back(s->int_value);
+		}
+		return output;
+	}
+
+	// _rebuild_parameter(data, requires_grad, backward_hooks)
+	if ((function == "torch._utils._rebuild_parameter" || function == "torch._utils._rebuild_parameter_with_state")
+		&& a.size() >= 1)
+	{
+		return a[0];
+	}
+
+	// _rebuild_from_type_v2(func, new_type, args, state)
+	if ((function == "torch._tensor._rebuild_from_type_v2" || function == "torch._tensor._rebuild_from_type")
+		&& a.size() >= 3)
+	{
+		return Call(a[0], a[2]);
+	}
+
+	if (function == "collections.OrderedDict")
+	{
+		PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Dict);
+		// OrderedDict([(k, v), ...])
+		if (a.size() == 1 && a[0]->kind == PickleObject::Kind::List)
+		{
+			for (const PickleObjectPtr& p : a[0]->items)
+			{
+				if (p->items.size() == 2)
+				{
+					output->items.push_back(p->items[0]);
+					output->items.push_back(p->items[1]);
+				}
+			}
+		}
+		return output;
+	}
+
+	return MakeObject(callable, args);
+}
+
+PickleObjectPtr Unpickler::PersistentLoad(const PickleObjectPtr& pid)
+{
+	// ('storage', storage_type, key, location, numel)
+	if (pid->kind != PickleObject::Kind::Tuple || pid->items.size() < 3 ||
+		pid->items[0]->str != "storage")
+	{
+		throw std::runtime_error("Unknown persistent id in pickle data");
+	}
+
+	const static std::map<std::string, StorageType> storage_types = {
+		{ "FloatStorage", StorageType::Float },
+		{ "DoubleStorage", StorageType::Double },
+		{ "HalfStorage", StorageType::Half },
+		{ "BFloat16Storage", StorageType::BFloat16 },
+		{ "LongStorage", StorageType::Long },
+		{ "IntStorage", StorageType::Int },
+		{ "ShortStorage", StorageType::Short },
+		{ "CharStorage", StorageType::Char },
+		{ "ByteStorage", StorageType::Byte },
+		{ "BoolStorage", StorageType::Bool }
+	};
+
+	PickleObjectPtr output = std::make_shared<PickleObject>(PickleObject::Kind::Storage);
+	auto it = storage_types.find(pid->items[1]->name);
+	output->tensor.type = it == storage_types.end() ? StorageType::Unknown : it->second;
+	output->tensor.storage_key = pid->items[2]->str;
+	output->tensor.storage_offset = 0;
+	return output;
+}
+
+void Unpickler::Build(const PickleObjectPtr& obj, const PickleObjectPtr& state)
+{
+	switch (obj->kind)
+	{
+	case PickleObject::Kind::Object:
+		// (state, slotstate) tuple for objects with __slots__
+		if (state->kind == PickleObject::Kind::Tuple && state->items.size() == 2 &&
+			state->items[0]->kind == PickleObject::Kind::Dict)
+		{
+			obj->state = state->items[0];
+		}
+		else
+		{
+			obj->state = state;
+		}
+		break;
+	case PickleObject::Kind::Dict:
+		if (state->kind == PickleObject::Kind::Dict)
+		{
+			obj->items.insert(obj->items.end(), state->items.begin(), state->items.end());
+		}
+		break;
+	default:
+		// Tensors and others: nothing we need in the state
+		break;
+	}
+}
+
+PickleObjectPtr Unpickler::Load()
+{
+	while (true)
+	{
+		const unsigned char opcode = Read<unsigned char>();
+		switch (opcode)
+		{
+		case 0x80: // PROTO
+			Read<unsigned char>();
+			break;
+		case 0x95: // FRAME
+			Read<uint64_t>();
+			break;
+		case '.': // STOP
+			return Pop();
+		case '(': // MARK
+			marks.push_back(stack.size());
+			break;
+		case '0': // POP
+			if (!marks.empty() && marks.back() == stack.size())
+			{
+				marks.pop_back();
+			}
+			else
+			{
+				Pop();
+			}
+			break;
+		case '1': // POP_MARK
+			PopMark();
+			break;
+		case '2': // DUP
+			stack.push_back(Top());
+			break;
+
+		// Constants
+		case 'N': // NONE
+			stack.push_back(std::make_shared<PickleObject>(PickleObject::Kind::None));
+			break;
+		case 0x88: // NEWTRUE
+		case 0x89: // NEWFALSE
+		{
+			PickleObjectPtr b = std::make_shared<PickleObject>(PickleObject::Kind::Bool);
+			b->int_value = opcode == 0x88;
+			stack.push_back(b);
+			break;
+		}
+
+		// Numbers
+		case 'J': // BININT
+			stack.push_back(MakeInt(Read<int32_t>()));
+			break;
+		case 'K': // BININT1
+			stack.push_back(MakeInt(Read<uint8_t>()));
+			break;
+		case 'M': // BININT2
+			stack.push_back(MakeInt(Read<uint16_t>()));
+			break;
+		case 0x8a: // LONG1
+			stack.push_back(MakeInt(ReadLong(Read<uint8_t>())));
+			break;
+		case 0x8b: // LONG4
+			stack.push_back(MakeInt(ReadLong(Read<uint32_t>())));
+			break;
+		case 'I': // INT
+		{
+			const std::string line = ReadLine();
+			if (line == "00" || line == "01")
+			{
+				PickleObjectPtr b = std::make_shared<PickleObject>(PickleObject::Kind::Bool);
+				b->int_value = line == "01";
+				stack.push_back(b);
+			}
+			else
+			{
+				stack.push_back(MakeInt(std::stoll(line)));
+			}
+			break;
+		}
+		case 'L': // LONG
+			stack.push_back(MakeInt(std::stoll(ReadLine())));
+			break;
+		case 'G': // BINFLOAT, big-endian double
+		{
+			const std::string bytes = ReadBytes(8);
+			uint64_t bits = 0;
+			for (size_t i = 0; i < 8; ++i)
+			{
+				bits = (bits << 8) | static_cast<unsigned char>(bytes[i]);
+			}
+			PickleObjectPtr f = std::make_shared<PickleObject>(PickleObject::Kind::Float);
+			std::memcpy(&f->float_value, &bits, 8);
+			stack.push_back(f);
+			break;
+		}
+		case 'F': // FLOAT
+		{
+			PickleObjectPtr f = std::make_shared<PickleObject>(PickleObject::Kind::Float);
+			f->float_value = std::stod(ReadLine());
+			stack.push_back(f);
+			break;
+		}
+
+		// Strings and bytes
+		case 'X': // BINUNICODE
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadBytes(Read<uint32_t>())));
+			break;
+		case 0x8c: // SHORT_BINUNICODE
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadBytes(Read<uint8_t>())));
+			break;
+		case 0x8d: // BINUNICODE8
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadBytes(Read<uint64_t>())));
+			break;
+		case 'V': // UNICODE
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadLine()));
+			break;
+		case 'T': // BINSTRING
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadBytes(Read<uint32_t>())));
+			break;
+		case 'U': // SHORT_BINSTRING
+			stack.push_back(MakeString(PickleObject::Kind::String, ReadBytes(Read<uint8_t>())));
+			break;
+		case 'S': // STRING, quoted repr
+		{
+			std::string line = ReadLine();
+			if (line.size() >= 2)
+			{
+				line = line.substr(1, line.size() - 2);
+			}
+			stack.push_back(MakeString(PickleObject::Kind::String, line));
+			break;
+		}
+		case 'B': // BINBYTES
+			stack.push_back(MakeString(PickleObject::Kind::Bytes, ReadBytes(Read<uint32_t>())));
+			break;
+		case 'C': // SHORT_BINBYTES
+			stack.push_back(MakeString(PickleObject::Kind::Bytes, ReadBytes(Read<uint8_t>())));
+			break;
+		case 0x8e: // BINBYTES8
+		case 0x96: // BYTEARRAY8
+			stack.push_back(MakeString(PickleObject::Kind::Bytes, ReadBytes(Read<uint64_t>())));
+			break;
+
+		// Collections
+		case ')': // EMPTY_TUPLE
+			stack.push_back(MakeCollection(PickleObject::Kind::Tuple, {}));
+			break;
+		case 't': // TUPLE
+			stack.push_back(MakeCollection(PickleObject::Kind::Tuple, PopMark()));
+			break;
+		case 0x85: // TUPLE1
+		case 0x86: // TUPLE2
+		case 0x87: // TUPLE3
+		{
+			const size_t n = opcode - 0x84;
+			if (stack.size() < n)
+			{
+				throw std::runtime_error("Empty stack while reading pickle data");
+			}
+			std::vector<PickleObjectPtr> items(stack.end() - n, stack.end());
+			stack.resize(stack.size() - n);
+			stack.push_back(MakeCollection(PickleObject::Kind::Tuple, items));
+			break;
+		}
+		case ']': // EMPTY_LIST
+			stack.push_back(MakeCollection(PickleObject::Kind::List, {}));
+			break;
+		case 'l': // LIST
+			stack.push_back(MakeCollection(PickleObject::Kind::List, PopMark()));
+			break;
+		case '}': // EMPTY_DICT
+			stack.push_back(MakeCollection(PickleObject::Kind::Dict, {}));
+			break;
+		case 'd': // DICT
+			stack.push_back(MakeCollection(PickleObject::Kind::Dict, PopMark()));
+			break;
+		case 0x8f: // EMPTY_SET
+			stack.push_back(MakeCollection(PickleObject::Kind::Set, {}));
+			break;
+		case 0x91: // FROZENSET
+			stack.push_back(MakeCollection(PickleObject::Kind::Set, PopMark()));
+			break;
+		case 'a': // APPEND
+		{
+			PickleObjectPtr value = Pop();
+			Top()->items.push_back(value);
+			break;
+		}
+		case 'e': // APPENDS
+		case 0x90: // ADDITEMS
+		case 'u': // SETITEMS
+		{
+			const std::vector<PickleObjectPtr> items = PopMark();
+			PickleObjectPtr collection = Top();
+			collection->items.insert(collection->items.end(), items.begin(), items.end());
+			break;
+		}
+		case 's': // SETITEM
+		{
+			PickleObjectPtr value = Pop();
+			PickleObjectPtr key = Pop();
+			PickleObjectPtr dict = Top();
+			dict->items.push_back(key);
+			dict->items.push_back(value);
+			break;
+		}
+
+		// Memo
+		case 'q': // BINPUT
+			memo[Read<uint8_t>()] = Top();
+			break;
+		case 'r': // LONG_BINPUT
+			memo[Read<uint32_t>()] = Top();
+			break;
+		case 'p': // PUT
+			memo[std::stoull(ReadLine())] = Top();
+			break;
+		case 0x94: // MEMOIZE
+			memo[memo.size()] = Top();
+			break;
+		case 'h': // BINGET
+		case 'j': // LONG_BINGET
+		case 'g': // GET
+		{
+			const uint64_t index = opcode == 'h' ? Read<uint8_t>() :
+				opcode == 'j' ? Read<uint32_t>() : std::stoull(ReadLine());
+			auto it = memo.find(index);
+			if (it == memo.end())
+			{
+				throw std::runtime_error("Unknown memo key in pickle data");
+			}
+			stack.push_back(it->second);
+			break;
+		}
+
+		// Objects
+		case 'c': // GLOBAL
+		{
+			const std::string module = ReadLine();
+			const std::string name = ReadLine();
+			stack.push_back(MakeGlobal(module, name));
+			break;
+		}
+		case 0x93: // STACK_GLOBAL
+		{
+			PickleObjectPtr name = Pop();
+			PickleObjectPtr module = Pop();
+			stack.push_back(MakeGlobal(module->str, name->str));
+			break;
+		}
+		case 'R': // REDUCE
+		{
+			PickleObjectPtr args = Pop();
+			PickleObjectPtr callable = Pop();
+			stack.push_back(Call(callable, args));
+			break;
+		}
+		case 0x81: // NEWOBJ
+		{
+			PickleObjectPtr args = Pop();
+			PickleObjectPtr cls = Pop();
+			stack.push_back(MakeObject(cls, args));
+			break;
+		}
+		case 0x92: // NEWOBJ_EX
+		{
+			Pop(); // kwargs
+			PickleObjectPtr args = Pop();
+			PickleObjectPtr cls = Pop();
+			stack.push_back(MakeObject(cls, args));
+			break;
+		}
+		case 'o': // OBJ
+		{
+			std::vector<PickleObjectPtr> items = PopMark();
+			if (items.empty())
+			{
+				throw std::runtime_error("Missing class in OBJ opcode while reading pickle data");
+			}
+			PickleObjectPtr cls = items[0];
+			items.erase(items.begin());
+			stack.push_back(MakeObject(cls, MakeCollection(PickleObject::Kind::Tuple, items)));
+			break;
+		}
+		case 'i': // INST
+		{
+			const std::string module = ReadLine();
+			const std::string name = ReadLine();
+			stack.push_back(MakeObject(MakeGlobal(module, name), MakeCollection(PickleObject::Kind::Tuple, PopMark())));
+			break;
+		}
+		case 'b': // BUILD
+		{
+			PickleObjectPtr state = Pop();
+			Build(Top(), state);
+			break;
+		}
+		case 'Q': // BINPERSID
+			stack.push_back(PersistentLoad(Pop()));
+			break;
+
+		default:
+			throw std::runtime_error("Unsupported pickle opcode " + std::to_string(opcode));
+		}
+	}
+}
+
+void CollectTensors(const PickleObjectPtr& obj, const std::string& prefix,
+	std::set<const PickleObject*>& visited, std::vector<std::pair<std::string, TensorInfo> >& output)
+{
+	if (!obj || visited.count(obj.get()))
+	{
+		return;
+	}
+	visited.insert(obj.get());
+
+	auto join = [&prefix](const std::string& name)
+	{
+		return prefix.empty() ? name : prefix + "." + name;
+	};
+
+	switch (obj->kind)
+	{
+	case PickleObject::Kind::Tensor:
+		output.push_back({ prefix, obj->tensor });
+		break;
+	case PickleObject::Kind::Dict:
+		for (size_t i = 0; i + 1 < obj->items.size(); i += 2)
+		{
+			const PickleObjectPtr& key = obj->items[i];
+			std::string name;
+			if (key->kind == PickleObject::Kind::String)
+			{
+				name = key->str;
+			}
+			else if (key->kind == PickleObject::Kind::Int)
+			{
+				name = std::to_string(key->int_value);
+			}
+			else
+			{
+				continue;
+			}
+
+			// Don't add the nn.Module internal dicts to the names
+			if (name == "_modules" || name == "_parameters" || name == "_buffers")
+			{
+				CollectTensors(obj->items[i + 1], prefix, visited, output);
+			}
+			else
+			{
+				CollectTensors(obj->items[i + 1], join(name), visited, output);
+			}
+		}
+		break;
+	case PickleObject::Kind::List:
+	case PickleObject::Kind::Tuple:
+		for (size_t i = 0; i < obj->items.size(); ++i)
+		{
+			CollectTensors(obj->items[i], join(std::to_string(i)), visited, output);
+		}
+		break;
+	case PickleObject::Kind::Object:
+		CollectTensors(obj->state, prefix, visited, output);
+		break;
+	default:
+		break;
+	}
+}
+
+std::vector<std::pair<std::string, TensorInfo> > ReadPickledTensors(const char* data, const size_t size)
+{
+	Unpickler unpickler(data, size);
+	PickleObjectPtr root = unpickler.Load();
+
+	std::vector<std::pair<std::string, TensorInfo> > output;
+	std::set<const PickleObject*> visited;
+	CollectTensors(root, "", visited, output);
+
+	return output;
+}
@@ -1,95 +1,222 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "WeightsLoading/inflate.hpp"
 #include "WeightsLoading/weights_loader.hpp"
 
-PythonWeightsFile::PythonWeightsFile(const std::string& path)
+PythonWeightsFile::PythonWeightsFile(const std::string& path, const bool memory_mapped)
 {
-    file = std::ifstream(path, std::ios::in | std::ios::binary);
+	if (memory_mapped)
+	{
+		mapped_file = std::unique_ptr<MemoryMappedFile>(new MemoryMappedFile(path));
+		file_size = mapped_file->Size();
+	}
+	else
+	{
+		file = std::ifstream(path, std::ios::in | std::ios::binary);
+		if (!file.is_open())
+		{
+			throw std::runtime_error("Can't open file " + path);
+		}
+		file.seekg(0, std::ios::end);
+		file_size = file.tellg();
+	}
 	next_tensor_index = 0;
     ReadHeaders();
 	ReadTensorOrder();
+	ReadTensorInfos();
 }
 
 PythonWeightsFile::~PythonWeightsFile()
 {
-	file.close();
+	if (file.is_open())
+	{
+		file.close();
+	}
+}
+
+void PythonWeightsFile::Read(const std::streamoff offset, const size_t size, char* dst)
+{
+	if (offset < 0 || offset + static_cast<std::streamoff>(size) > file_size)
+	{
+		throw std::runtime_error("Trying to read outside of zip file");
+	}
+
+	if (mapped_file)
+	{
+		std::memcpy(dst, mapped_file->Data() + offset, size);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(file_mutex);
+		file.seekg(offset);
+		file.read(dst, size);
+	}
+}
+
+template<typename T>
+T ReadLittleEndian(const char* src)
+{
+	T output;
+	std::memcpy(&output, src, sizeof(T));
+	return output;
 }
 
 void PythonWeightsFile::ReadHeaders()
 {
-	file.seekg(-20, std::ios::end);
-	std::streamoff eocd_pos = file.tellg();
+	// The EOCD record is at least 22 bytes, followed
+	// by a comment of at most 65535 bytes. Load this
+	// whole area at once and search the signature in it
+	// instead of reading the file one byte at a time.
+	const std::streamoff tail_size = std::min<std::streamoff>(file_size, 22 + 65535);
+	std::vector<char> tail(tail_size);
+	Read(file_size - tail_size, tail_size, tail.data());
+
+	std::streamoff eocd_pos = tail_size - 22;
 
 	// Search for the EOCD signature header
-	while (eocd_pos >= std::ios::beg)
+	while (eocd_pos >= 0)
 	{
-		file.seekg(eocd_pos);
-		unsigned int val;
-		file.read(reinterpret_cast<char*>(&val), 4);
-		if (val == 0x06054b50)
+		if (ReadLittleEndian<unsigned int>(tail.data() + eocd_pos) == 0x06054b50)
 		{
 			break;
 		}
 		eocd_pos -= 1;
 	}
 
-	if (eocd_pos < std::ios::beg)
+	if (eocd_pos < 0)
 	{
 		throw std::runtime_error("Can't find EOCD header in zip file");
 	}
 
-	unsigned short number_entries;
-	file.seekg(6, std::ios::cur);
-	file.read(reinterpret_cast<char*>(&number_entries), 2);
-
-	unsigned int central_offset, central_size;
-	file.read(reinterpret_cast<char*>(&central_size), 4);
-	file.read(reinterpret_cast<char*>(&central_offset), 4);
+	const unsigned short number_entries = ReadLittleEndian<unsigned short>(tail.data() + eocd_pos + 10);
+	const unsigned int central_size = ReadLittleEndian<unsigned int>(tail.data() + eocd_pos + 12);
+	const unsigned int central_offset = ReadLittleEndian<unsigned int>(tail.data() + eocd_pos + 16);
 
 	// Create the entry vector
 	entries = std::vector<ZipEntry>(number_entries);
 
-	file.seekg(central_offset);
+	// Read the whole central directory at once
+	std::vector<char> central(central_size);
+	Read(central_offset, central_size, central.data());
+
+	size_t pos = 0;
 	for (int i = 0; i < number_entries; ++i)
 	{
-		unsigned short name_length, extra_length, comment_length;
-		unsigned int file_offset;
-
-		file.seekg(10, std::ios::cur);
-		file.read(reinterpret_cast<char*>(&entries[i].compression), 2);
-		file.seekg(8, std::ios::cur);
-		file.read(reinterpret_cast<char*>(&entries[i].compressed_size), 4);
-		file.read(reinterpret_cast<char*>(&entries[i].uncompressed_size), 4);
-		file.read(reinterpret_cast<char*>(&name_length), 2);
-		file.read(reinterpret_cast<char*>(&extra_length), 2);
-		file.read(reinterpret_cast<char*>(&comment_length), 2);
-		file.seekg(8, std::ios::cur);
-		file.read(reinterpret_cast<char*>(&file_offset), 4);
-		entries[i].header_offset = file_offset;
-		entries[i].name.resize(name_length);
-		file.read(&entries[i].name[0], name_length);
-		file.seekg(extra_length + comment_length, std::ios::cur);
+		if (pos + 46 > central.size())
+		{
+			throw std::runtime_error("Corrupted central directory in zip file");
+		}
+		const char* header = central.data() + pos;
+
+		entries[i].compression = ReadLittleEndian<unsigned short>(header + 10);
+		entries[i].compressed_size = ReadLittleEndian<unsigned int>(header + 20);
+		entries[i].uncompressed_size = ReadLittleEndian<unsigned int>(header + 24);
+		const unsigned short name_length = ReadLittleEndian<unsigned short>(header + 28);
+		const unsigned short extra_length = ReadLittleEndian<unsigned short>(header + 30);
+		const unsigned short comment_length = ReadLittleEndian<unsigned short>(header + 32);
+		entries[i].header_offset = ReadLittleEndian<unsigned int>(header + 42);
+
+		if (pos + 46 + name_length > central.size())
+		{
+			throw std::runtime_error("Corrupted central directory in zip file");
+		}
+		entries[i].name = std::string(header + 46, name_length);
+		pos += 46 + name_length + extra_length + comment_length;
 	}
 
 	// Second loop through all the local header to get the data offsets
+	char local_lengths[4];
 	for (int i = 0; i < number_entries; ++i)
 	{
-		file.seekg(entries[i].header_offset + 26, std::ios::beg);
+		Read(entries[i].header_offset + 26, 4, local_lengths);
 
-		unsigned short name_length, extra_length;
-		file.read(reinterpret_cast<char*>(&name_length), 2);
-		file.read(reinterpret_cast<char*>(&extra_length), 2);
+		const unsigned short name_length = ReadLittleEndian<unsigned short>(local_lengths);
+		const unsigned short extra_length = ReadLittleEndian<unsigned short>(local_lengths + 2);
 		entries[i].data_offset = entries[i].header_offset + 30 + name_length + extra_length;
 	}
+
+	// Find the root folder of the archive, it depends
+	// on the name of the file when it was saved
+	archive_prefix = "archive/";
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const std::string& name = entries[i].name;
+		if (name.size() >= 8 && name.compare(name.size() - 8, 8, "data.pkl") == 0)
+		{
+			archive_prefix = name.substr(0, name.size() - 8);
+			break;
+		}
+	}
+
+	const std::string data_prefix = archive_prefix + "data/";
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		if (entries[i].name.compare(0, data_prefix.size(), data_prefix) == 0)
+		{
+			storage_entries[entries[i].name.substr(data_prefix.size())] = i;
+		}
+	}
 }
 
 std::vector<char> PythonWeightsFile::GetData(const size_t index)
 {
-	std::vector<char> output(entries[index].uncompressed_size);
-	file.seekg(entries[index].data_offset);
-	file.read(output.data(), entries[index].uncompressed_size);
+	const ZipEntry& entry = entries[index];
+	std::vector<char> output(entry.uncompressed_size);
+
+	if (entry.compression == 0)
+	{
+		Read(entry.data_offset, entry.uncompressed_size, output.data());
+		return output;
+	}
+
+	if (entry.compression != 8)
+	{
+		throw std::runtime_error("Compression method " + std::to_string(entry.compression) + " not supported");
+	}
+
+	std::vector<char> compressed(entry.compressed_size);
+	Read(entry.data_offset, entry.compressed_size, compressed.data());
+
+	size_t pos = 0;
+	pos = Inflate(compressed.data(), compressed.size(), output.size(), [&](const char* data, const size_t size)
+		{
+			std::memcpy(output.data() + pos, data, size);
+			pos += size;
+		});
+	if (pos != output.size())
+	{
+		throw std::runtime_error("Corrupted compressed entry " + entry.name + " in zip file");
+	}
 
 	return output;
 }
 
+RawTensorData PythonWeightsFile::GetDataView(const size_t index)
+{
+	if (entries[index].compression != 0)
+	{
+		throw std::runtime_error("Can't get a view on compressed entry " + entries[index].name);
+	}
+
+	const std::streamoff offset = entries[index].data_offset;
+	const size_t size = entries[index].uncompressed_size;
+
+	if (mapped_file)
+	{
+		if (offset + static_cast<std::streamoff>(size) > file_size)
+		{
+			throw std::runtime_error("Trying to read outside of zip file");
+		}
+		return RawTensorData{ mapped_file->Data() + offset, size };
+	}
+
+	buffer.resize(size);
+	Read(offset, size, buffer.data());
+	return RawTensorData{ buffer.data(), size };
+}
+
 bool is_digit(const char c)
 {
 	return c > 0x2F && c < 0x3A;
@@ -109,28 +236,206 @@ void PythonWeightsFile::ReadTensorOrder()
 
 	for (size_t i = 0; i < entries.size(); ++i)
 	{
-		for (size_t j = 0; j < entries.size(); ++j)
+		auto it = storage_entries.find(std::to_string(i));
+		if (it != storage_entries.end())
+		{
+			tensor_order.push_back(it->second);
+		}
+	}
+}
+
+void PythonWeightsFile::ReadTensorInfos()
+{
+	tensor_infos.clear();
+	tensor_names.clear();
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		if (entries[i].name != archive_prefix + "data.pkl")
 		{
-			if (entries[j].name == "archive/data/" + std::to_string(i))
+			continue;
+		}
+
+		// data.pkl is optional for the positional
+		// loading, so don't fail if we can't read it
+		try
+		{
+			const std::vector<char> pickle = GetData(i);
+			tensor_infos = ReadPickledTensors(pickle.data(), pickle.size());
+		}
+		catch (const std::exception&)
+		{
+			tensor_infos.clear();
+		}
+		break;
+	}
+
+	for (size_t i = 0; i < tensor_infos.size(); ++i)
+	{
+		tensor_names.insert({ tensor_infos[i].first, i });
+	}
+}
+
+const std::vector<std::pair<std::string, TensorInfo> >& PythonWeightsFile::GetTensorInfos() const
+{
+	return tensor_infos;
+}
+
+const TensorInfo* PythonWeightsFile::FindTensor(const std::string& name) const
+{
+	auto it = tensor_names.find(name);
+	if (it == tensor_names.end())
+	{
+		return nullptr;
+	}
+	return &tensor_infos[it->second].second;
+}
+
+size_t PythonWeightsFile::GetTensorEntry(const TensorInfo& tensor, size_t& offset, size_t& size) const
+{
+	auto it = storage_entries.find(tensor.storage_key);
+	if (it == storage_entries.end())
+	{
+		throw std::runtime_error("Can't find storage " + tensor.storage_key + " in zip archive");
+	}
+
+	const unsigned short compression = entries[it->second].compression;
+	if (compression != 0 && compression != 8)
+	{
+		throw std::runtime_error("Compression method " + std::to_string(compression) + " not supported");
+	}
+
+	if (!tensor.IsContiguous())
+	{
+		throw std::runtime_error("Can't read a non contiguous tensor");
+	}
+
+	const size_t element_size = StorageElementSize(tensor.type);
+	offset = tensor.storage_offset * element_size;
+	size = tensor.Numel() * element_size;
+	if (element_size == 0 || offset + size > entries[it->second].uncompressed_size)
+	{
+		throw std::runtime_error("Tensor data outside of storage " + tensor.storage_key);
+	}
+
+	return it->second;
+}
+
+RawTensorData PythonWeightsFile::GetTensorView(const TensorInfo& tensor)
+{
+	size_t offset, size;
+	const ZipEntry& entry = entries[GetTensorEntry(tensor, offset, size)];
+	if (entry.compression != 0)
+	{
+		throw std::runtime_error("Can't get a view on compressed storage " + tensor.storage_key);
+	}
+
+	if (mapped_file)
+	{
+		return RawTensorData{ mapped_file->Data() + entry.data_offset + offset, size };
+	}
+
+	buffer.resize(size);
+	Read(entry.data_offset + offset, size, buffer.data());
+	return RawTensorData{ buffer.data(), size };
+}
+
+bool PythonWeightsFile::IsCompressed(const TensorInfo& tensor) const
+{
+	auto it = storage_entries.find(tensor.storage_key);
+	return it != storage_entries.end() && entries[it->second].compression != 0;
+}
+
+void PythonWeightsFile::ReadTensor(const TensorInfo& tensor,
+	const std::function<void(const char*, const size_t, const size_t)>& callback)
+{
+	size_t offset, size;
+	const ZipEntry& entry = entries[GetTensorEntry(tensor, offset, size)];
+
+	// Only the compressed bytes are read, never the whole
+	// uncompressed entry. Nothing at all if memory mapped.
+	std::vector<char> local_buffer;
+	const char* data = nullptr;
+	const size_t data_size = entry.compression == 0 ? size : entry.compressed_size;
+	const std::streamoff data_offset = entry.compression == 0 ? entry.data_offset + offset : entry.data_offset;
+	if (mapped_file)
+	{
+		if (data_offset + static_cast<std::streamoff>(data_size) > file_size)
+		{
+			throw std::runtime_error("Trying to read outside of zip file");
+		}
+		data = mapped_file->Data() + data_offset;
+	}
+	else
+	{
+		local_buffer.resize(data_size);
+		Read(data_offset, data_size, local_buffer.data());
+		data = local_buffer.data();
+	}
+
+	if (entry.compression == 0)
+	{
+		callback(data, 0, size);
+		return;
+	}
+
+	// Decompress up to the end of the tensor and only
+	// give the part of each chunk inside the tensor
+	size_t pos = 0;
+	const size_t decompressed_size = Inflate(data, data_size, offset + size, [&](const char* chunk, const size_t chunk_size)
+		{
+			const size_t begin = std::max(pos, offset);
+			const size_t end = pos + chunk_size;
+			if (end > begin)
 			{
-				tensor_order.push_back(j);
-				break;
+				callback(chunk + begin - pos, begin - offset, end - begin);
 			}
-		}
+			pos = end;
+		});
+
+	if (decompressed_size != offset + size)
+	{
+		throw std::runtime_error("Corrupted compressed storage " + tensor.storage_key + " in zip file");
 	}
 }
 
-std::vector<char> PythonWeightsFile::GetNextTensor()
+size_t PythonWeightsFile::NextTensorEntry()
 {
 	if (next_tensor_index == tensor_order.size())
 	{
 		throw std::runtime_error("No more tensor in zip archive");
 	}
 
-	if (entries[tensor_order[next_tensor_index]].compression != 0)
+	const unsigned short compression = entries[tensor_order[next_tensor_index]].compression;
+	if (compression != 0 && compression != 8)
 	{
-		throw std::runtime_error("Compression method " + std::to_string(entries[tensor_order[next_tensor_index]].compression) + " not supported");
+		throw std::runtime_error("Compression method " + std::to_string(compression) + " not supported");
 	}
 
-	return GetData(tensor_order[next_tensor_index++]);
+	return tensor_order[next_tensor_index++];
+}
+
+std::vector<char> PythonWeightsFile::GetNextTensor()
+{
+	return GetData(NextTensorEntry());
+}
+
+RawTensorData PythonWeightsFile::GetNextTensorView()
+{
+	return GetDataView(NextTensorEntry());
+}
+
+TensorInfo PythonWeightsFile::GetNextTensorInfo(const StorageType type)
+{
+	const ZipEntry& entry = entries[NextTensorEntry()];
+	const size_t element_size = std::max<size_t>(StorageElementSize(type), 1);
+
+	TensorInfo output;
+	output.type = type;
+	output.storage_key = entry.name.substr(archive_prefix.size() + 5);
+	output.storage_offset = 0;
+	output.shape = { static_cast<int64_t>(entry.uncompressed_size / element_size) };
+	output.stride = { 1 };
+
+	return output;
 }
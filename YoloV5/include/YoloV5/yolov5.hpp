@@ -1,5 +1,7 @@
 #pragma once
 
+#include <map>
+
 #include <torch/torch.h>
 
 enum class KnownBlock
@@ -14,6 +16,56 @@ enum class KnownBlock
 	Detect
 };
 
+/// <summary>
+/// Parsed description of a block of the network,
+/// with everything needed to build it again
+/// without reading the yaml file
+/// </summary>
+struct BlockConfig
+{
+	KnownBlock type;
+	std::vector<int> from;
+	int depth;
+	int channel_in;
+	int channel_out;
+	// Type specific arguments:
+	// Conv: kernel size, stride, padding
+	// Focus, SPPF: kernel size
+	// SPP: kernel sizes
+	// C3: shortcut
+	// Upsample: scale factor, nearest mode
+	// Concat: dimension
+	// Detect: num class, input channels of each output
+	std::vector<int> args;
+	// Only used by Detect
+	std::vector<std::vector<int> > anchors;
+};
+
+/// <summary>
+/// Options of YoloV5Impl::NonMaxSuppression on candidates
+/// </summary>
+struct NMSOptions
+{
+	// Minimum confidence (objectness * class score) of a detection
+	float conf_threshold = 0.25f;
+	float iou_threshold = 0.45f;
+	// Classes to keep, removed before NMS. All classes are kept if empty
+	std::vector<int> classes;
+	// Confidence thresholds replacing conf_threshold for some classes
+	std::map<int, float> class_conf_thresholds;
+	// Max number of boxes per image entering NMS, the ones with the highest scores are kept
+	int max_nms = 30000;
+	// Max number of detections per image
+	int max_det = 300;
+	// If true, boxes of different classes can suppress each other
+	bool agnostic = false;
+
+	/// <summary>
+	/// Get the lowest confidence threshold a kept box can have
+	/// </summary>
+	float MinConfThreshold() const;
+};
+
 class YoloV5BlockImpl : public torch::nn::Module
 {
 public:
@@ -21,7 +73,21 @@ public:
 		const KnownBlock type_, torch::nn::Sequential seq_);
 	~YoloV5BlockImpl();
 
-	torch::Tensor forward(std::vector<torch::Tensor> x);
+	torch::Tensor forward(const std::vector<torch::Tensor>& x);
+
+	/// <summary>
+	/// Same as forward, but the result is written in out
+	/// (e.g. a channel slice of a concat output). Autograd
+	/// must be disabled.
+	/// </summary>
+	void ForwardInto(const std::vector<torch::Tensor>& x, torch::Tensor out);
+
+	/// <summary>
+	/// True if ForwardInto writes the output directly in
+	/// out, false if it would be computed and then copied
+	/// </summary>
+	bool CanForwardInto() const;
+
 	const std::vector<int>& From() const;
 	const KnownBlock Type() const;
 
@@ -36,10 +102,20 @@ private:
 };
 TORCH_MODULE(YoloV5Block);
 
+class YoloV5;
+
 class YoloV5Impl : public torch::nn::Module
 {
 public:
 	YoloV5Impl(const std::string& config_path, const int num_in_channels_);
+
+	/// <summary>
+	/// Create a network from a snapshot saved with SaveSnapshot.
+	/// The snapshot is mapped in memory, no config parsing nor
+	/// weights fusion is done, the network is ready to run.
+	/// </summary>
+	/// <param name="snapshot_path">Path to the snapshot file</param>
+	YoloV5Impl(const std::string& snapshot_path);
 	~YoloV5Impl();
 
 	torch::Tensor forward(torch::Tensor x);
@@ -50,6 +126,130 @@ public:
 
 	void FuseConvAndBN();
 
+	/// <summary>
+	/// Merge layers that can be computed together, once
+	/// FuseConvAndBN has been called: C3 cv1 and cv2, which
+	/// share their input, become one conv, and Focus slicing
+	/// is folded into a strided conv on the raw input. The
+	/// network can't be saved as a snapshot after this.
+	/// </summary>
+	void FuseGraph();
+
+	/// <summary>
+	/// Set the type used for the weights and the activations
+	/// (kFloat, kBFloat16 or kHalf). Should be called after
+	/// FuseConvAndBN so the fusion is computed in fp32. Box
+	/// decoding in Detect and NMS always stay in fp32.
+	/// </summary>
+	/// <param name="dtype">Type used in the network</param>
+	void SetPrecision(const torch::Dtype dtype);
+
+	/// <summary>
+	/// Get the type used for the weights and the activations.
+	/// Inputs are converted to this type in forward.
+	/// </summary>
+	torch::Dtype GetPrecision() const;
+
+	/// <summary>
+	/// Keep activations in channels last (NHWC) memory format
+	/// through the whole network, conv weights are converted
+	/// once here. Should be called after FuseConvAndBN, FuseGraph
+	/// and SetPrecision, as they create new weights.
+	/// </summary>
+	/// <param name="channels_last_">If true, use channels last, otherwise contiguous NCHW</param>
+	void SetChannelsLast(const bool channels_last_);
+	bool IsChannelsLast() const;
+
+	/// <summary>
+	/// Freeze the fp32 CPU convs for inference: their weights are
+	/// packed once in oneDNN blocked layout for the first input shape
+	/// they see, instead of being reordered on each call. Other input
+	/// shapes use the regular convs. Replicas share the packed weights.
+	/// </summary>
+	/// <param name="prepacked">If true, use prepacked convs</param>
+	void SetPrepacked(const bool prepacked);
+
+	/// <summary>
+	/// Fold the [0, 255] to [0, 1] normalization and the channel
+	/// order reversal (BGR to RGB) into the weights of the first
+	/// conv (Focus or Conv stem). forward then takes raw BGR
+	/// images, e.g. uint8, converted to the network precision
+	/// without any other pass over the data. Must be called
+	/// before int8 quantization. The network can't be saved
+	/// as a snapshot after this.
+	/// </summary>
+	void FoldInputNormalization();
+	bool IsRawInput() const;
+
+	/// <summary>
+	/// Save the architecture, the strides and the weights
+	/// in a single binary file that can be loaded without
+	/// any parsing. FuseConvAndBN must have been called before.
+	/// </summary>
+	/// <param name="snapshot_path">Output file</param>
+	/// <param name="dtype">Type used to store floating point weights (kFloat, kBFloat16 or kHalf).
+	/// The network loaded from the snapshot will run with this precision.</param>
+	void SaveSnapshot(const std::string& snapshot_path, const torch::Dtype dtype = torch::kFloat);
+
+	/// <summary>
+	/// Create a new network with the same architecture, whose
+	/// parameters and buffers point to the same storage as this
+	/// one's instead of a copy. Useful to run several replicas
+	/// (e.g. one per stream) while paying the weights memory only
+	/// once. Shared weights must not be modified in place after
+	/// this call. To share weights across processes, load the
+	/// same fp32 snapshot in each of them, its memory mapping
+	/// is shared by the OS.
+	/// </summary>
+	/// <returns>The new network</returns>
+	YoloV5 Replicate() const;
+
+	/// <summary>
+	/// Only compute the outputs of some classes in Detect. The rows
+	/// of the other classes are removed from the output convs, and
+	/// class indices of the candidates and detections are mapped back
+	/// to the original ones. A restricted network can't be saved
+	/// as a snapshot.
+	/// This is not the same as filtering classes after detection:
+	/// the best class of a box is chosen among the kept classes only,
+	/// so a box whose best class was removed (dog 0.9, person 0.3) is
+	/// reported with its best kept class (person, obj * 0.3) instead
+	/// of being dropped.
+	/// </summary>
+	/// <param name="classes">Original indices of the classes to keep</param>
+	void RestrictClasses(const std::vector<int>& classes);
+
+	/// <summary>
+	/// Run calibration data through the backbone to record the
+	/// range of the activations of each Conv. The first call
+	/// starts a new calibration, until QuantizeInt8 is called.
+	/// Network must be fused, in fp32 and on CPU.
+	/// </summary>
+	/// <param name="x">A batch of representative preprocessed images</param>
+	void CalibrateInt8(const torch::Tensor& x);
+
+	/// <summary>
+	/// Switch the Conv blocks to int8 using the calibrated ranges,
+	/// with weights quantized per output channel. Each layer is
+	/// validated on the first calibration batch and stays in fp32
+	/// if its relative error is too high. Detect stays in fp32.
+	/// </summary>
+	/// <param name="max_error">Max relative L2 error of a layer output</param>
+	void QuantizeInt8(const float max_error = 0.05f);
+
+	/// <summary>
+	/// Save the int8 parameters of all Conv blocks in a text file
+	/// </summary>
+	/// <param name="path">Output file</param>
+	void SaveInt8Params(const std::string& path) const;
+
+	/// <summary>
+	/// Load int8 parameters saved with SaveInt8Params and
+	/// switch the corresponding Conv blocks to int8
+	/// </summary>
+	/// <param name="path">Int8 parameters file</param>
+	void LoadInt8Params(const std::string& path);
+
 	/// <summary>
 	/// Perform NMS on forward results.
 	/// </summary>
@@ -60,16 +260,127 @@ public:
 	std::vector<torch::Tensor> NonMaxSuppression(torch::Tensor prediction,
 		float conf_threshold = 0.25f, float iou_threshold = 0.45f);
 
+	/// <summary>
+	/// Same as forward, but only the anchors above the confidence
+	/// threshold are decoded, which is much faster than decoding
+	/// all of them and filtering in NonMaxSuppression.
+	/// </summary>
+	/// <param name='x'>Input images</param>
+	/// <param name='conf_threshold'>Confidence threshold</param>
+	/// <returns>A vector of size batch. For each image a tensor of size [num candidates, 6 (x1, y1, x2, y2, conf, cls)]</returns>
+	std::vector<torch::Tensor> DetectCandidates(torch::Tensor x, float conf_threshold = 0.25f);
+
+	/// <summary>
+	/// Same as DetectCandidates, with the lowest confidence threshold of the options
+	/// </summary>
+	/// <param name='x'>Input images</param>
+	/// <param name='options'>Options that will be used for NMS</param>
+	/// <returns>A vector of size batch. For each image a tensor of size [num candidates, 6 (x1, y1, x2, y2, conf, cls)]</returns>
+	std::vector<torch::Tensor> DetectCandidates(torch::Tensor x, const NMSOptions& options);
+
+	/// <summary>
+	/// Perform NMS on candidates from DetectCandidates.
+	/// </summary>
+	/// <param name='candidates'>For each image, a tensor of size [num candidates, 6 (x1, y1, x2, y2, conf, cls)]</param>
+	/// <param name='iou_threshold'>IoU threshold</param>
+	/// <returns>A vector of size batch. For each image a tensor of size [num det kept, 6 (x1, y1, x2, y2, conf, cls)]</returns>
+	std::vector<torch::Tensor> NonMaxSuppression(const std::vector<torch::Tensor>& candidates,
+		float iou_threshold = 0.45f);
+
+	/// <summary>
+	/// Perform NMS on candidates from DetectCandidates. Candidates
+	/// are filtered by class and confidence before NMS, and only the
+	/// max_nms best ones of each image are processed.
+	/// </summary>
+	/// <param name='candidates'>For each image, a tensor of size [num candidates, 6 (x1, y1, x2, y2, conf, cls)]</param>
+	/// <param name='options'>Thresholds, filters and limits</param>
+	/// <returns>A vector of size batch. For each image a tensor of size [num det kept, 6 (x1, y1, x2, y2, conf, cls)], in decreasing score order</returns>
+	std::vector<torch::Tensor> NonMaxSuppression(const std::vector<torch::Tensor>& candidates,
+		const NMSOptions& options);
+
 private:
+	YoloV5Impl(const std::vector<BlockConfig>& block_configs_, const int num_in_channels_);
 	std::vector<torch::Tensor> forward_backbone(torch::Tensor x);
+	/// <summary>
+	/// Run the backbone and gather the inputs of Detect
+	/// </summary>
+	std::vector<torch::Tensor> forward_detect_inputs(torch::Tensor x);
 	void ParseConfig(const std::string& config_path);
+	void BuildModules();
+	/// <summary>
+	/// Compute which block outputs must be kept during
+	/// the forward pass and when they can be released
+	/// </summary>
+	void BuildExecutionPlan();
+	/// <summary>
+	/// Compute the output sizes of all blocks, the channel
+	/// offsets in concat outputs and the activation pool
+	/// buffer of each block from the activations liveness
+	/// </summary>
+	void ComputePlanSizes(const torch::IntArrayRef input_sizes);
+	/// <summary>
+	/// Get the output of a step as a view of its activation pool
+	/// buffer. The buffer is allocated on first use and kept
+	/// for the next forwards with the same input shape.
+	/// </summary>
+	torch::Tensor PooledActivation(const int step, const torch::TensorOptions& options);
+	/// <summary>
+	/// Drop the packed weights of all convs after their weights are replaced
+	/// </summary>
+	void ResetPrepackedWeights();
+	void LoadSnapshot(const std::string& snapshot_path);
 	void SetStride();
+	void SetDetectStride();
+	/// <summary>
+	/// Convert class indices of the (restricted) Detect to original indices
+	/// </summary>
+	torch::Tensor MapClasses(const torch::Tensor& cls) const;
 	void InitWeights();
 
 private:
+	struct ExecutionStep
+	{
+		// Absolute indices of the input blocks, -1 for the network input
+		std::vector<int> inputs;
+		// True if the output is used later than by the next block
+		bool save_output;
+		// Saved outputs that are not used after this step
+		std::vector<int> release;
+		// Concat step this block writes its output into, -1 if none
+		int concat_slot;
+		// Channel of the concat output where this block output starts
+		int64_t concat_offset;
+		// Concat steps only, true for each input already written in place
+		std::vector<bool> input_in_place;
+		// Concat steps only, channel of the output where each input starts
+		std::vector<int64_t> input_offsets;
+		// Output sizes for plan_input_sizes
+		std::vector<int64_t> output_sizes;
+		// Activation pool buffer holding the output, -1 if not pooled
+		int pool_buffer;
+	};
+
+private:
+	std::vector<BlockConfig> block_configs;
 	torch::nn::ModuleList module_list;
-	std::vector<bool> save_module_output;
+	// One step per block, the last one is Detect
+	std::vector<ExecutionStep> execution_plan;
+	// Input sizes used to compute the plan sizes
+	std::vector<int64_t> plan_input_sizes;
+	// Number of elements of each activation pool buffer
+	std::vector<int64_t> pool_sizes;
+	// Buffers shared by the block outputs whose lifetimes don't overlap
+	std::vector<torch::Tensor> activation_pool;
 	int num_in_channels;
 	torch::Tensor strides;
+	torch::Dtype precision;
+	bool channels_last;
+	// Original index of each class of Detect, empty if not restricted
+	std::vector<int> class_map;
+	bool graph_fused;
+	// True if the input normalization is folded in the first conv
+	bool raw_input;
+	// First calibration batch, used to validate int8 layers
+	torch::Tensor int8_validation_input;
 };
 TORCH_MODULE(YoloV5);
@@ -1,20 +1,173 @@
 #pragma once
 
+#include <mutex>
+
 #include <torch/torch.h>
 
+/// <summary>
+/// State of the int8 path of a Conv
+/// </summary>
+enum class Int8Mode
+{
+	// Conv runs in fp32
+	Disabled,
+	// Conv runs in fp32 and records the range of its input and output
+	Calibration,
+	// Conv runs in fp32 and records the error of the int8 path
+	Validation,
+	// Conv runs in int8
+	Enabled
+};
+
+/// <summary>
+/// Activation quantization parameters of a Conv,
+/// weights are quantized per output channel with
+/// scales computed from the weights themselves
+/// </summary>
+struct ConvInt8Params
+{
+	double input_scale;
+	int64_t input_zero_point;
+	double output_scale;
+	int64_t output_zero_point;
+};
+
+/// <summary>
+/// oneDNN conv context with the weights packed for one
+/// input shape, shared by a Conv and its replicas
+/// </summary>
+struct ConvPrepackedWeights
+{
+	std::mutex mutex;
+	// None until the first forward
+	c10::IValue context;
+	std::vector<int64_t> input_sizes;
+};
+
 class ConvImpl : public torch::nn::Module
 {
 public:
 	ConvImpl(int channels_in, int channels_out, 
 		int kernel_size = 1, int stride = 1, int padding = -1);
+
+	/// <summary>
+	/// Create an already fused Conv from a biased conv
+	/// </summary>
+	/// <param name="fused_conv">Conv with bias, replacing conv and bn</param>
+	/// <param name="padding_">Padding used by fused_conv</param>
+	ConvImpl(torch::nn::Conv2d fused_conv, const int padding_);
 	~ConvImpl();
 	torch::Tensor forward(torch::Tensor x);
+
+	/// <summary>
+	/// Same as forward, but the activation writes the result
+	/// in out (e.g. a channel slice of a concat output)
+	/// instead of a new tensor. Autograd must be disabled.
+	/// </summary>
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
 	void FuseConvAndBN();
+	bool IsFused() const;
+
+	/// <summary>
+	/// Replace conv and bn with a single biased conv, without
+	/// computing fused weights. Used before loading weights that
+	/// have already been fused.
+	/// </summary>
+	void RemoveBN();
+
+	/// <summary>
+	/// Change the int8 state of this conv. Calibration resets the
+	/// recorded ranges, Validation resets the recorded error.
+	/// Validation and Enabled require int8 params to be set.
+	/// </summary>
+	void SetInt8Mode(const Int8Mode mode);
+	Int8Mode GetInt8Mode() const;
+
+	/// <summary>
+	/// Compute activation quantization parameters from the ranges
+	/// recorded during calibration, and quantize the weights
+	/// </summary>
+	void ComputeInt8Params();
+
+	/// <summary>
+	/// Set activation quantization parameters (e.g. loaded from
+	/// a file) and quantize the weights. Must be fused first.
+	/// </summary>
+	void SetInt8Params(const ConvInt8Params& params);
+	const ConvInt8Params& GetInt8Params() const;
+
+	/// <summary>
+	/// Relative L2 error of the int8 conv output compared to
+	/// fp32 output, accumulated during Validation
+	/// </summary>
+	float GetInt8Error() const;
+
+	/// <summary>
+	/// Get the underlying convolution (without bn if fused)
+	/// </summary>
+	torch::nn::Conv2d GetConv() const;
+	int GetPadding() const;
+
+	/// <summary>
+	/// Run the fp32 CPU conv with weights prepacked once in the
+	/// oneDNN blocked layout. Weights are packed for the first input
+	/// shape seen, other shapes fall back to the regular conv. Does
+	/// nothing if torch is not built with oneDNN or with autograd.
+	/// </summary>
+	void SetPrepacked(const bool prepacked_);
+	bool IsPrepacked() const;
+
+	/// <summary>
+	/// Drop the packed weights, they are packed again on the
+	/// next forward. Must be called when the weights are replaced.
+	/// </summary>
+	void ResetPrepackedWeights();
+
+	/// <summary>
+	/// Share packed weights with another conv using the same
+	/// weights, they are packed once by whichever runs first
+	/// </summary>
+	void SetPrepackedWeights(const std::shared_ptr<ConvPrepackedWeights>& weights);
+	const std::shared_ptr<ConvPrepackedWeights>& GetPrepackedWeights() const;
+
+	/// <summary>
+	/// Fold a transformation of the input into the weights, so
+	/// conv(x) becomes conv(scale * x[:, input_channels]).
+	/// Zero padding is unchanged as the transformation is linear.
+	/// </summary>
+	/// <param name="input_channels">Permutation of the channels, input channel c of the original conv receives x[:, input_channels[c]]</param>
+	/// <param name="scale">Scale applied to the input</param>
+	void FoldInputTransform(const std::vector<int64_t>& input_channels, const double scale);
+
+private:
+	torch::nn::Conv2d CreateFusedConv() const;
+	/// <summary>
+	/// SiLU, computed in place when autograd is disabled
+	/// </summary>
+	torch::Tensor Activation(torch::Tensor y);
+	torch::Tensor ForwardInt8(const torch::Tensor& x) const;
+	/// <summary>
+	/// Conv without activation, using prepacked weights if possible
+	/// </summary>
+	torch::Tensor ForwardConv(const torch::Tensor& x);
 
 private:
 	torch::nn::Conv2d conv;
 	torch::nn::BatchNorm2d bn;
 	torch::nn::SiLU act;
+	int padding;
+
+	Int8Mode int8_mode;
+	ConvInt8Params int8_params;
+	// Prepacked quantized weights
+	c10::IValue int8_weights;
+	float input_min, input_max;
+	float output_min, output_max;
+	double error_sum, reference_sum;
+
+	bool prepacked;
+	// Null if not prepacked
+	std::shared_ptr<ConvPrepackedWeights> prepacked_weights;
 };
 TORCH_MODULE(Conv);
 
@@ -29,9 +182,27 @@ public:
 	~FocusImpl();
 
 	torch::Tensor forward(torch::Tensor x);
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
+
+	/// <summary>
+	/// Replace the space to depth slicing and the conv with
+	/// a single conv on the input, with a twice larger kernel,
+	/// stride and padding. Conv must be fused first.
+	/// </summary>
+	void FuseSlicing();
+
+	/// <summary>
+	/// Same as ConvImpl::FoldInputTransform, channels are
+	/// given for the Focus input, not for each slice
+	/// </summary>
+	void FoldInputTransform(const std::vector<int64_t>& input_channels, const double scale);
+
+private:
+	torch::Tensor Slice(const torch::Tensor& x) const;
 
 private:
 	Conv conv;
+	bool sliced;
 };
 TORCH_MODULE(Focus);
 
@@ -62,6 +233,7 @@ public:
 	~BottleneckImpl();
 
 	torch::Tensor forward(torch::Tensor x);
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
 
 private:
 	Conv cv1, cv2;
@@ -80,9 +252,26 @@ public:
 	~C3Impl();
 
 	torch::Tensor forward(torch::Tensor x);
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
+
+	/// <summary>
+	/// Replace cv1 and cv2, which are both applied to the input,
+	/// with a single conv computing their outputs at once.
+	/// Convs must be fused first.
+	/// </summary>
+	void FuseInputConvs();
+
+private:
+	/// <summary>
+	/// Compute the input of cv3, each part being
+	/// directly written in its slice of the output
+	/// </summary>
+	torch::Tensor ForwardConcat(const torch::Tensor& x);
 
 private:
 	Conv cv1, cv2, cv3;
+	// cv1 and cv2 merged, output is [cv1, cv2]
+	Conv cv12;
 	torch::nn::Sequential m;
 };
 TORCH_MODULE(C3);
@@ -98,6 +287,14 @@ public:
 	~SPPImpl();
 
 	torch::Tensor forward(torch::Tensor x);
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
+
+private:
+	/// <summary>
+	/// Compute the input of cv2, cv1 output being
+	/// directly written in its slice of the output
+	/// </summary>
+	torch::Tensor ForwardConcat(const torch::Tensor& x);
 
 private:
 	Conv cv1, cv2;
@@ -116,6 +313,14 @@ public:
 	~SPPFImpl();
 
 	torch::Tensor forward(torch::Tensor x);
+	void ForwardInto(const torch::Tensor& x, torch::Tensor out);
+
+private:
+	/// <summary>
+	/// Compute the input of cv2, cv1 output being
+	/// directly written in its slice of the output
+	/// </summary>
+	torch::Tensor ForwardConcat(const torch::Tensor& x);
 
 private:
 	Conv cv1, cv2;
@@ -135,10 +340,36 @@ public:
 
 	torch::Tensor forward(std::vector<torch::Tensor> x);
 
+	/// <summary>
+	/// Decode only the anchors that can pass the confidence threshold.
+	/// Objectness is compared to the threshold before the sigmoid, then
+	/// boxes, class scores and argmax are computed for the kept anchors.
+	/// </summary>
+	/// <param name="x">Inputs of each detection layer</param>
+	/// <param name="conf_threshold">Confidence threshold (objectness * class score)</param>
+	/// <returns>For each image, a [K, 6 (x1, y1, x2, y2, conf, cls)] tensor</returns>
+	std::vector<torch::Tensor> ForwardCandidates(const std::vector<torch::Tensor>& x, const float conf_threshold);
+
 	void SetStride(torch::Tensor stride_);
 
+	/// <summary>
+	/// Only keep the outputs of some classes, removing
+	/// the other rows of the output convs. Class indices
+	/// in the results are then indices in this list, and
+	/// the best class of a box is chosen among them only.
+	/// </summary>
+	/// <param name="classes">Current indices of the classes to keep</param>
+	void RestrictClasses(const std::vector<int>& classes);
+
+	int NumClass() const;
+
 private:
 	static torch::Tensor make_grid(int n_x, int n_y);
+	/// <summary>
+	/// Apply the output conv of layer i and return a fp32
+	/// [batch, anchor, y, x, output] view of the result
+	/// </summary>
+	torch::Tensor ForwardLayer(const int i, const torch::Tensor& x);
 
 private:
 	torch::Tensor stride;
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "YoloV5/yolov5.hpp"
+
+/// <summary>
+/// Everything needed to create a ready to run YoloV5 network
+/// </summary>
+struct Snapshot
+{
+	int num_in_channels;
+	std::vector<BlockConfig> blocks;
+	std::vector<float> strides;
+	std::vector<std::pair<std::string, torch::Tensor> > tensors;
+};
+
+/// <summary>
+/// Write a snapshot in a binary file. Each tensor data is
+/// aligned on 64 bytes so it can be used from a memory mapping.
+/// </summary>
+/// <param name="path">Output file</param>
+/// <param name="snapshot">Snapshot to save</param>
+void WriteSnapshotFile(const std::string& path, const Snapshot& snapshot);
+
+/// <summary>
+/// Read a snapshot saved with WriteSnapshotFile. The file is
+/// mapped in memory and the tensors directly point to it, they
+/// are read-only and keep the mapping alive as long as they exist.
+/// </summary>
+/// <param name="path">Snapshot file</param>
+/// <returns>The loaded snapshot</returns>
+Snapshot ReadSnapshotFile(const std::string& path);
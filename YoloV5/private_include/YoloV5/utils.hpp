@@ -2,6 +2,8 @@
 
 #include <torch/torch.h>
 
+#include <WeightsLoading/weights_loader.hpp>
+
 int make_divisible(const float x, const int div);
 
 // Convert [x, y, w, h] boxes to [x1, y1, x2, y2] top left, bottom right
@@ -9,7 +11,11 @@ torch::Tensor xywh2xyxy(torch::Tensor x);
 
 // TODO, GPU support would also be nice (https://github.com/pytorch/vision/blob/7947fc8fb38b1d3a2aca03f22a2e6a3caa63f2a0/torchvision/csrc/ops/cuda/nms_kernel.cu)
 /// <summary>
-/// Perform Non-Maximum Suppression over the given boxes (on CPU)
+/// Perform Non-Maximum Suppression over the given boxes (on CPU).
+/// Boxes are split in groups whose x ranges don't overlap, then
+/// each group is processed in score order, computing IoU for 8/16
+/// boxes at a time with AVX2/AVX-512 if the CPU supports them and
+/// storing suppressed boxes as bits. The result is the same as the usual greedy NMS.
 /// </summary>
 /// <param name="boxes">[N, 4](Float) tensor, x1, y1 (top left), x2, y2 (bottom right)</param>
 /// <param name="scores">[N](Float) tensor, score for each box</param>
@@ -17,4 +23,61 @@ torch::Tensor xywh2xyxy(torch::Tensor x);
 /// <returns>A [n](Long) tensor of kept indices, with n <= N</returns>
 torch::Tensor nms_kernel(const torch::Tensor& boxes_, const torch::Tensor& scores_, const float iou_threshold);
 
-void CopyRawDataToTensor(const std::vector<char>& src, torch::Tensor& dst);
\ No newline at end of file
+/// <summary>
+/// Same as nms_kernel, on a subset of boxes stored in CPU
+/// float arrays. Can be called from multiple threads.
+/// </summary>
+/// <param name="boxes">Pointer to the first box, x1, y1 (top left), x2, y2 (bottom right)</param>
+/// <param name="boxes_stride">Number of floats between two boxes</param>
+/// <param name="scores">Pointer to the first score</param>
+/// <param name="scores_stride">Number of floats between two scores</param>
+/// <param name="indices">Indices of the boxes to process</param>
+/// <param name="iou_threshold">IoU threshold for suppression</param>
+/// <returns>Kept indices, in decreasing score order</returns>
+std::vector<int64_t> nms_kernel(const float* boxes, const size_t boxes_stride,
+	const float* scores, const size_t scores_stride,
+	const std::vector<int64_t>& indices, const float iou_threshold);
+
+/// <summary>
+/// Compute stride 1 max pools of x with "same" padding for
+/// increasing odd kernel sizes, in a single pass over x. Each
+/// pool is computed from the previous one with a small separable
+/// row/column max, on blocks of channels that stay in cache.
+/// Only CPU tensors are supported.
+/// </summary>
+/// <param name="x">[N, C, H, W] input, any strides (e.g. a channel slice)</param>
+/// <param name="kernel_sizes">Increasing odd kernel sizes</param>
+/// <param name="outputs">One [N, C, H, W] tensor per kernel size, any strides, written in place</param>
+void MaxPoolPyramid(const torch::Tensor& x, const std::vector<int>& kernel_sizes, std::vector<torch::Tensor>& outputs);
+
+/// <summary>
+/// Convert half precision values to float,
+/// using F16C/AVX-512 instructions if the CPU supports them
+/// </summary>
+/// <param name="src">Half precision values, as raw IEEE 754 binary16</param>
+/// <param name="dst">Output buffer, at least n floats</param>
+/// <param name="n">Number of values to convert</param>
+void HalfToFloat(const uint16_t* src, float* dst, const size_t n);
+
+/// <summary>
+/// Get the torch type corresponding to a .pt file storage type
+/// </summary>
+torch::Dtype StorageTypeToDtype(const StorageType type);
+
+/// <summary>
+/// Get the .pt file storage type corresponding to a torch type
+/// </summary>
+StorageType DtypeToStorageType(const torch::Dtype type);
+
+/// <summary>
+/// Load tensors from a .pt file, converting them from their saved
+/// type to the type of the destination tensor. Half to float
+/// conversion is done directly from the source bytes. Stored
+/// tensors are split in chunks spread across all threads, while
+/// compressed ones are decompressed directly into the destination,
+/// one entry per thread.
+/// </summary>
+/// <param name="weights">File to read the tensors from</param>
+/// <param name="src">Description of each tensor in the file</param>
+/// <param name="dst">Tensors to set, their shapes must match the data</param>
+void CopyWeightsToTensors(PythonWeightsFile& weights, const std::vector<TensorInfo>& src, std::vector<torch::Tensor>& dst);
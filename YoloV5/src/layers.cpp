@@ -1,18 +1,47 @@
+#include <cmath>
+#include <limits>
+
+#include <ATen/core/dispatch/Dispatcher.h>
+
 #include "YoloV5/layers.hpp"
+#include "YoloV5/utils.hpp"
 
 
 ConvImpl::ConvImpl(int channels_in, int channels_out,
-    int kernel_size, int stride, int padding) :
+    int kernel_size, int stride, int padding_) :
     conv(torch::nn::Conv2dOptions(channels_in, channels_out, kernel_size)
-        .stride(stride).padding(padding == -1 ? kernel_size / 2 : padding).padding_mode(torch::kZeros).bias(false)),
+        .stride(stride).padding(padding_ == -1 ? kernel_size / 2 : padding_).padding_mode(torch::kZeros).bias(false)),
     bn(channels_out),
-    act(torch::nn::SiLU())
+    act(torch::nn::SiLU()),
+    padding(padding_ == -1 ? kernel_size / 2 : padding_),
+    int8_mode(Int8Mode::Disabled),
+    int8_params({ 1.0, 0, 1.0, 0 }),
+    input_min(std::numeric_limits<float>::max()), input_max(std::numeric_limits<float>::lowest()),
+    output_min(std::numeric_limits<float>::max()), output_max(std::numeric_limits<float>::lowest()),
+    error_sum(0.0), reference_sum(0.0),
+    prepacked(false)
 {
     register_module("conv", conv);
     register_module("bn", bn);
     register_module("act", act);
 }
 
+ConvImpl::ConvImpl(torch::nn::Conv2d fused_conv, const int padding_) :
+    conv(fused_conv),
+    bn(nullptr),
+    act(torch::nn::SiLU()),
+    padding(padding_),
+    int8_mode(Int8Mode::Disabled),
+    int8_params({ 1.0, 0, 1.0, 0 }),
+    input_min(std::numeric_limits<float>::max()), input_max(std::numeric_limits<float>::lowest()),
+    output_min(std::numeric_limits<float>::max()), output_max(std::numeric_limits<float>::lowest()),
+    error_sum(0.0), reference_sum(0.0),
+    prepacked(false)
+{
+    register_module("conv", conv);
+    register_module("act", act);
+}
+
 ConvImpl::~ConvImpl()
 {
 
@@ -20,41 +49,366 @@ ConvImpl::~ConvImpl()
 
 torch::Tensor ConvImpl::forward(torch::Tensor x)
 {
-    if (bn.is_empty())
+    if (!bn.is_empty())
     {
-        return act(conv(x));
+        return Activation(bn(conv(x)));
     }
-    else
+
+    switch (int8_mode)
+    {
+    case Int8Mode::Calibration:
+    {
+        input_min = std::min(input_min, x.min().item<float>());
+        input_max = std::max(input_max, x.max().item<float>());
+        torch::Tensor y = conv(x);
+        output_min = std::min(output_min, y.min().item<float>());
+        output_max = std::max(output_max, y.max().item<float>());
+        return Activation(y);
+    }
+    case Int8Mode::Validation:
+    {
+        // Downstream layers still get the fp32 output,
+        // so the error is measured for this layer only
+        torch::Tensor y = conv(x);
+        error_sum += (ForwardInt8(x) - y).pow(2).sum().item<double>();
+        reference_sum += y.pow(2).sum().item<double>();
+        return Activation(y);
+    }
+    case Int8Mode::Enabled:
+        return Activation(ForwardInt8(x));
+    default:
+        return Activation(ForwardConv(x));
+    }
+}
+
+torch::Tensor ConvImpl::Activation(torch::Tensor y)
+{
+    // y is always a new tensor, so without autograd
+    // SiLU can reuse its memory instead of allocating
+    if (!torch::GradMode::is_enabled())
+    {
+        return torch::silu_(y);
+    }
+    return act(y);
+}
+
+void ConvImpl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    switch (bn.is_empty() ? int8_mode : Int8Mode::Calibration)
     {
-        return act(bn(conv(x)));
+    case Int8Mode::Enabled:
+        torch::silu_out(out, ForwardInt8(x));
+        break;
+    case Int8Mode::Disabled:
+        torch::silu_out(out, ForwardConv(x));
+        break;
+    default:
+        // Not fused or recording int8 stats, nothing to save here
+        out.copy_(forward(x));
+        break;
     }
 }
 
 void ConvImpl::FuseConvAndBN()
 {
-    torch::nn::Conv2d fused_conv(torch::nn::Conv2dOptions(
-        conv->options.in_channels(), conv->options.out_channels(),
-        conv->options.kernel_size()).stride(conv->options.stride())
-        .padding(conv->options.padding()).groups(conv->options.groups())
-        .bias(true));
+    torch::nn::Conv2d fused_conv = CreateFusedConv();
+
+    // Fusion is always computed in fp32, even
+    // if the weights are in reduced precision
+    const torch::Dtype dtype = conv->weight.scalar_type();
+    const torch::Device device = conv->weight.device();
+    const torch::Tensor bn_weight = bn->weight.to(torch::kFloat);
+    const torch::Tensor bn_bias = bn->bias.to(torch::kFloat);
+    const torch::Tensor running_mean = bn->running_mean.to(torch::kFloat);
+    const torch::Tensor running_var = bn->running_var.to(torch::kFloat);
 
     // Set fused weights
-    torch::Tensor w_conv = conv->weight.clone().view({ conv->options.out_channels(), -1 });
-    torch::Tensor w_bn = torch::diag(bn->weight.div(torch::sqrt(bn->options.eps() + bn->running_var)));
+    torch::Tensor w_conv = conv->weight.to(torch::kFloat).view({ conv->options.out_channels(), -1 });
+    torch::Tensor w_bn = torch::diag(bn_weight.div(torch::sqrt(bn->options.eps() + running_var)));
 
     fused_conv->weight.copy_(torch::mm(w_bn, w_conv).view(fused_conv->weight.sizes()));
 
     // Set fused bias
-    torch::Tensor b_conv = torch::zeros(conv->weight.size(0), torch::TensorOptions().device(conv->weight.device()));
-    torch::Tensor b_bn = bn->bias - bn->weight.mul(bn->running_mean).div(torch::sqrt(bn->running_var + bn->options.eps()));
+    torch::Tensor b_conv = torch::zeros(conv->weight.size(0), torch::TensorOptions().device(device));
+    torch::Tensor b_bn = bn_bias - bn_weight.mul(running_mean).div(torch::sqrt(running_var + bn->options.eps()));
 
     fused_conv->bias.copy_(torch::mm(w_bn, b_conv.reshape({ -1, 1 })).reshape(-1) + b_bn);
 
+    fused_conv->to(device, dtype);
+
     conv = replace_module("conv", fused_conv);
 
     bn = nullptr;
     unregister_module("bn");
 
+    ResetPrepackedWeights();
+
+}
+
+bool ConvImpl::IsFused() const
+{
+    return bn.is_empty();
+}
+
+void ConvImpl::RemoveBN()
+{
+    conv = replace_module("conv", CreateFusedConv());
+
+    bn = nullptr;
+    unregister_module("bn");
+
+    ResetPrepackedWeights();
+}
+
+void ConvImpl::SetInt8Mode(const Int8Mode mode)
+{
+    if ((mode == Int8Mode::Validation || mode == Int8Mode::Enabled) && int8_weights.isNone())
+    {
+        throw std::runtime_error("Int8 params must be set before enabling int8 conv");
+    }
+
+    if (mode == Int8Mode::Calibration)
+    {
+        input_min = std::numeric_limits<float>::max();
+        input_max = std::numeric_limits<float>::lowest();
+        output_min = std::numeric_limits<float>::max();
+        output_max = std::numeric_limits<float>::lowest();
+    }
+    else if (mode == Int8Mode::Validation)
+    {
+        error_sum = 0.0;
+        reference_sum = 0.0;
+    }
+
+    int8_mode = mode;
+}
+
+Int8Mode ConvImpl::GetInt8Mode() const
+{
+    return int8_mode;
+}
+
+void ConvImpl::ComputeInt8Params()
+{
+    if (input_min > input_max || output_min > output_max)
+    {
+        throw std::runtime_error("Conv didn't see any calibration data");
+    }
+
+    // Asymmetric quint8 with the range reduced to 7 bits, as
+    // fbgemm kernels can overflow when using the full 8 bits
+    auto compute_qparams = [](float min, float max, double& scale, int64_t& zero_point)
+    {
+        min = std::min(min, 0.0f);
+        max = std::max(max, 0.0f);
+        scale = std::max(static_cast<double>(max - min) / 127.0, 1e-8);
+        zero_point = std::min<int64_t>(127, std::max<int64_t>(0, std::llround(-min / scale)));
+    };
+
+    ConvInt8Params params;
+    compute_qparams(input_min, input_max, params.input_scale, params.input_zero_point);
+    compute_qparams(output_min, output_max, params.output_scale, params.output_zero_point);
+
+    SetInt8Params(params);
+}
+
+void ConvImpl::SetInt8Params(const ConvInt8Params& params)
+{
+    if (!bn.is_empty())
+    {
+        throw std::runtime_error("FuseConvAndBN must be called before quantizing a conv");
+    }
+    if (!conv->weight.device().is_cpu() || conv->weight.scalar_type() != torch::kFloat)
+    {
+        throw std::runtime_error("Int8 conv is only available for fp32 networks on CPU");
+    }
+
+    int8_params = params;
+
+    // Symmetric per output channel weight quantization
+    const torch::Tensor weight = conv->weight.detach().contiguous();
+    const torch::Tensor scales = std::get<0>(weight.abs().view({ weight.size(0), -1 }).max(1))
+        .clamp_min(1e-8).div(127.0).to(torch::kDouble);
+    const torch::Tensor q_weight = torch::quantize_per_channel(weight, scales,
+        torch::zeros({ weight.size(0) }, torch::kLong), 0, torch::kQInt8);
+
+    const int64_t stride = conv->options.stride()->at(0);
+    const int64_t dilation = conv->options.dilation()->at(0);
+
+    static const c10::OperatorHandle prepack = c10::Dispatcher::singleton().findSchemaOrThrow("quantized::conv2d_prepack", "");
+    torch::jit::Stack stack = {
+        q_weight,
+        conv->bias.detach(),
+        std::vector<int64_t>{ stride, stride },
+        std::vector<int64_t>{ padding, padding },
+        std::vector<int64_t>{ dilation, dilation },
+        conv->options.groups()
+    };
+    prepack.callBoxed(&stack);
+    int8_weights = stack[0];
+}
+
+const ConvInt8Params& ConvImpl::GetInt8Params() const
+{
+    return int8_params;
+}
+
+float ConvImpl::GetInt8Error() const
+{
+    return reference_sum > 0.0 ? static_cast<float>(std::sqrt(error_sum / reference_sum)) : 0.0f;
+}
+
+torch::Tensor ConvImpl::ForwardInt8(const torch::Tensor& x) const
+{
+    static const c10::OperatorHandle quantized_conv = c10::Dispatcher::singleton().findSchemaOrThrow("quantized::conv2d", "new");
+
+    torch::jit::Stack stack = {
+        torch::quantize_per_tensor(x, int8_params.input_scale, int8_params.input_zero_point, torch::kQUInt8),
+        int8_weights,
+        int8_params.output_scale,
+        int8_params.output_zero_point
+    };
+    quantized_conv.callBoxed(&stack);
+
+    // There is no quantized SiLU, so the
+    // activation is computed in fp32
+    return stack[0].toTensor().dequantize();
+}
+
+void ConvImpl::SetPrepacked(const bool prepacked_)
+{
+    prepacked = prepacked_;
+    ResetPrepackedWeights();
+}
+
+bool ConvImpl::IsPrepacked() const
+{
+    return prepacked;
+}
+
+void ConvImpl::ResetPrepackedWeights()
+{
+    // A new object, as replicas sharing the old one keep the old weights
+    prepacked_weights = prepacked ? std::make_shared<ConvPrepackedWeights>() : nullptr;
+}
+
+void ConvImpl::SetPrepackedWeights(const std::shared_ptr<ConvPrepackedWeights>& weights)
+{
+    prepacked = weights != nullptr;
+    prepacked_weights = weights;
+}
+
+const std::shared_ptr<ConvPrepackedWeights>& ConvImpl::GetPrepackedWeights() const
+{
+    return prepacked_weights;
+}
+
+void ConvImpl::FoldInputTransform(const std::vector<int64_t>& input_channels, const double scale)
+{
+    if (!int8_weights.isNone())
+    {
+        throw std::runtime_error("Input transformation must be folded before int8 quantization");
+    }
+    if (static_cast<int64_t>(input_channels.size()) != conv->options.in_channels())
+    {
+        throw std::runtime_error("Wrong number of input channels to fold in conv");
+    }
+
+    // Old input channel c receives x[:, input_channels[c]], so new
+    // weight channel input_channels[c] takes the old weights of c
+    std::vector<int64_t> inverse(input_channels.size(), -1);
+    for (size_t c = 0; c < input_channels.size(); ++c)
+    {
+        const int64_t src = input_channels[c];
+        if (src < 0 || src >= static_cast<int64_t>(inverse.size()) || inverse[src] != -1)
+        {
+            throw std::runtime_error("Input channels to fold in conv must be a permutation");
+        }
+        inverse[src] = c;
+    }
+
+    torch::NoGradGuard no_grad;
+
+    const torch::Tensor indices = torch::tensor(inverse, torch::TensorOptions().dtype(torch::kLong)).to(conv->weight.device());
+    conv->weight.set_data(conv->weight.index_select(1, indices).to(torch::kFloat).mul_(scale)
+        .to(conv->weight.scalar_type()).contiguous(conv->weight.suggest_memory_format()));
+
+    ResetPrepackedWeights();
+}
+
+torch::Tensor ConvImpl::ForwardConv(const torch::Tensor& x)
+{
+    // Only registered if torch is built with oneDNN
+    static const c10::optional<c10::OperatorHandle> prepack_op = c10::Dispatcher::singleton().findSchema({ "mkldnn_prepacked::conv2d_prepack", "" });
+    static const c10::optional<c10::OperatorHandle> run_op = c10::Dispatcher::singleton().findSchema({ "mkldnn_prepacked::conv2d_run", "" });
+
+    if (!prepacked || !prepack_op || !run_op || torch::GradMode::is_enabled() ||
+        !x.device().is_cpu() || x.scalar_type() != torch::kFloat || conv->weight.scalar_type() != torch::kFloat)
+    {
+        return conv(x);
+    }
+
+    c10::IValue context;
+    {
+        // Replicas running in other threads can share these weights
+        std::lock_guard<std::mutex> lock(prepacked_weights->mutex);
+        if (prepacked_weights->context.isNone())
+        {
+            const int64_t stride = conv->options.stride()->at(0);
+            const int64_t dilation = conv->options.dilation()->at(0);
+
+            torch::jit::Stack stack = {
+                conv->weight.detach(),
+                conv->bias.detach(),
+                std::vector<int64_t>{ stride, stride },
+                std::vector<int64_t>{ padding, padding },
+                std::vector<int64_t>{ dilation, dilation },
+                conv->options.groups(),
+                x.sizes().vec(),
+                std::string("none")
+            };
+            prepack_op->callBoxed(&stack);
+            prepacked_weights->context = stack[0];
+            prepacked_weights->input_sizes = x.sizes().vec();
+        }
+        if (x.sizes() == torch::IntArrayRef(prepacked_weights->input_sizes))
+        {
+            context = prepacked_weights->context;
+        }
+    }
+
+    // Weights are packed for the first input
+    // shape, other shapes use the regular conv
+    if (context.isNone())
+    {
+        return conv(x);
+    }
+
+    torch::jit::Stack stack = {
+        x.contiguous(x.suggest_memory_format()),
+        context
+    };
+    run_op->callBoxed(&stack);
+    return stack[0].toTensor();
+}
+
+torch::nn::Conv2d ConvImpl::GetConv() const
+{
+    return conv;
+}
+
+int ConvImpl::GetPadding() const
+{
+    return padding;
+}
+
+torch::nn::Conv2d ConvImpl::CreateFusedConv() const
+{
+    return torch::nn::Conv2d(torch::nn::Conv2dOptions(
+        conv->options.in_channels(), conv->options.out_channels(),
+        conv->options.kernel_size()).stride(conv->options.stride())
+        .padding(conv->options.padding()).groups(conv->options.groups())
+        .bias(true));
 }
 
 
@@ -62,7 +416,8 @@ void ConvImpl::FuseConvAndBN()
 
 FocusImpl::FocusImpl(int channels_in, int channels_out,
     int kernel_size) :
-    conv(Conv(4 * channels_in, channels_out, kernel_size))
+    conv(Conv(4 * channels_in, channels_out, kernel_size)),
+    sliced(true)
 {
     register_module("conv", conv);
 }
@@ -74,12 +429,93 @@ FocusImpl::~FocusImpl()
 // x(b, c, w, h)-->y(b, 4c, w / 2, h / 2)
 torch::Tensor FocusImpl::forward(torch::Tensor x)
 {
-    return conv(torch::cat({
+    return conv(Slice(x));
+}
+
+void FocusImpl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    conv->ForwardInto(Slice(x), out);
+}
+
+torch::Tensor FocusImpl::Slice(const torch::Tensor& x) const
+{
+    if (!sliced)
+    {
+        return x;
+    }
+
+    return torch::cat({
             x.index({"...", torch::indexing::Slice(0, torch::indexing::None, 2), torch::indexing::Slice(0, torch::indexing::None, 2) }),
             x.index({"...", torch::indexing::Slice(1, torch::indexing::None, 2), torch::indexing::Slice(0, torch::indexing::None, 2) }),
             x.index({"...", torch::indexing::Slice(0, torch::indexing::None, 2), torch::indexing::Slice(1, torch::indexing::None, 2) }),
             x.index({"...", torch::indexing::Slice(1, torch::indexing::None, 2), torch::indexing::Slice(1, torch::indexing::None, 2) })        
-        }, 1));
+        }, 1);
+}
+
+void FocusImpl::FuseSlicing()
+{
+    if (!sliced)
+    {
+        return;
+    }
+
+    if (!conv->IsFused())
+    {
+        throw std::runtime_error("Focus conv must be fused before removing the slicing");
+    }
+
+    torch::NoGradGuard no_grad;
+
+    const torch::nn::Conv2d src = conv->GetConv();
+    const int64_t channels_out = src->options.out_channels();
+    const int64_t channels_in = src->options.in_channels() / 4;
+    const int64_t kernel_size = src->options.kernel_size()->at(0);
+    const int64_t stride = src->options.stride()->at(0);
+    const int padding = conv->GetPadding();
+
+    // Slice g of the input contains pixels (2y + dy[g], 2x + dx[g]),
+    // so W'[:, c, 2ky + dy[g], 2kx + dx[g]] = W[:, g * C + c, ky, kx]
+    const int64_t dy[4] = { 0, 1, 0, 1 };
+    const int64_t dx[4] = { 0, 0, 1, 1 };
+    torch::Tensor weight = torch::zeros({ channels_out, channels_in, 2 * kernel_size, 2 * kernel_size }, src->weight.options());
+    for (int g = 0; g < 4; ++g)
+    {
+        weight.index_put_({ torch::indexing::Slice(), torch::indexing::Slice(),
+            torch::indexing::Slice(dy[g], torch::indexing::None, 2),
+            torch::indexing::Slice(dx[g], torch::indexing::None, 2) },
+            src->weight.index({ torch::indexing::Slice(), torch::indexing::Slice(g * channels_in, (g + 1) * channels_in) }));
+    }
+
+    torch::nn::Conv2d fused_conv(torch::nn::Conv2dOptions(channels_in, channels_out, 2 * kernel_size)
+        .stride(2 * stride).padding(2 * padding).bias(true));
+    fused_conv->weight.set_data(weight.contiguous(src->weight.suggest_memory_format()));
+    fused_conv->bias.set_data(src->bias.detach().clone());
+
+    conv = replace_module("conv", Conv(fused_conv, 2 * padding));
+    sliced = false;
+}
+
+void FocusImpl::FoldInputTransform(const std::vector<int64_t>& input_channels, const double scale)
+{
+    if (!sliced)
+    {
+        conv->FoldInputTransform(input_channels, scale);
+        return;
+    }
+
+    // Each of the 4 slices contains all the input channels
+    const int64_t channels_in = input_channels.size();
+    std::vector<int64_t> slices_channels;
+    slices_channels.reserve(4 * channels_in);
+    for (int g = 0; g < 4; ++g)
+    {
+        for (const int64_t c : input_channels)
+        {
+            slices_channels.push_back(g * channels_in + c);
+        }
+    }
+
+    conv->FoldInputTransform(slices_channels, scale);
 }
 
 
@@ -124,7 +560,29 @@ BottleneckImpl::~BottleneckImpl()
 
 torch::Tensor BottleneckImpl::forward(torch::Tensor x)
 {
-    return add ? x + cv2(cv1(x)) : cv2(cv1(x));
+    if (!add)
+    {
+        return cv2(cv1(x));
+    }
+
+    // Accumulate the residual in the conv output
+    if (!torch::GradMode::is_enabled())
+    {
+        return cv2(cv1(x)).add_(x);
+    }
+    return x + cv2(cv1(x));
+}
+
+void BottleneckImpl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    if (add)
+    {
+        torch::add_out(out, x, cv2(cv1(x)));
+    }
+    else
+    {
+        cv2->ForwardInto(cv1(x), out);
+    }
 }
 
 
@@ -134,7 +592,8 @@ C3Impl::C3Impl(int channels_in, int channels_out,
     int n, bool shortcut, float expansion) :
     cv1(Conv(channels_in, (int)(channels_out * expansion), 1, 1)),
     cv2(Conv(channels_in, (int)(channels_out * expansion), 1, 1)),
-    cv3(Conv(2 * (int)(channels_out * expansion), channels_out, 1, 1))
+    cv3(Conv(2 * (int)(channels_out * expansion), channels_out, 1, 1)),
+    cv12(nullptr)
 {
     register_module("cv1", cv1);
     register_module("cv2", cv2);
@@ -154,10 +613,100 @@ C3Impl::~C3Impl()
 
 torch::Tensor C3Impl::forward(torch::Tensor x)
 {
-    return cv3(torch::cat({
-        m->forward(cv1(x)),
-        cv2(x)
-        }, 1));
+    if (torch::GradMode::is_enabled())
+    {
+        torch::Tensor y1;
+        torch::Tensor y2;
+        if (!cv12.is_empty())
+        {
+            const torch::Tensor y = cv12(x);
+            const int64_t hidden = y.size(1) / 2;
+            y1 = y.narrow(1, 0, hidden);
+            y2 = y.narrow(1, hidden, hidden);
+        }
+        else
+        {
+            y1 = cv1(x);
+            y2 = cv2(x);
+        }
+        for (size_t i = 0; i < m->size(); ++i)
+        {
+            y1 = m[i]->as<Bottleneck>()->forward(y1);
+        }
+        return cv3(torch::cat({ y1, y2 }, 1));
+    }
+
+    return cv3(ForwardConcat(x));
+}
+
+void C3Impl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    cv3->ForwardInto(ForwardConcat(x), out);
+}
+
+torch::Tensor C3Impl::ForwardConcat(const torch::Tensor& x)
+{
+    const int64_t hidden = cv3->GetConv()->options.in_channels() / 2;
+    torch::Tensor y = torch::empty({ x.size(0), 2 * hidden, x.size(2), x.size(3) },
+        x.options().memory_format(x.suggest_memory_format()));
+    torch::Tensor y1 = y.narrow(1, 0, hidden);
+    torch::Tensor y2 = y.narrow(1, hidden, hidden);
+
+    if (!cv12.is_empty())
+    {
+        cv12->ForwardInto(x, y);
+    }
+    else
+    {
+        cv1->ForwardInto(x, y1);
+        cv2->ForwardInto(x, y2);
+    }
+
+    if (m->size() == 0)
+    {
+        return y;
+    }
+
+    // The bottlenecks start from cv1 output, and the
+    // last one writes its result back in the same slice
+    torch::Tensor z = y1;
+    for (size_t i = 0; i + 1 < m->size(); ++i)
+    {
+        z = m[i]->as<Bottleneck>()->forward(z);
+    }
+    m[m->size() - 1]->as<Bottleneck>()->ForwardInto(z, y1);
+
+    return y;
+}
+
+void C3Impl::FuseInputConvs()
+{
+    if (!cv12.is_empty())
+    {
+        return;
+    }
+
+    if (!cv1->IsFused() || !cv2->IsFused())
+    {
+        throw std::runtime_error("C3 convs must be fused before merging them");
+    }
+
+    torch::NoGradGuard no_grad;
+
+    const torch::nn::Conv2d src1 = cv1->GetConv();
+    const torch::nn::Conv2d src2 = cv2->GetConv();
+
+    torch::nn::Conv2d fused_conv(torch::nn::Conv2dOptions(src1->options.in_channels(),
+        src1->options.out_channels() + src2->options.out_channels(), 1).bias(true));
+    fused_conv->weight.set_data(torch::cat({ src1->weight, src2->weight }, 0).contiguous(src1->weight.suggest_memory_format()));
+    fused_conv->bias.set_data(torch::cat({ src1->bias, src2->bias }, 0));
+
+    cv12 = register_module("cv12", Conv(fused_conv, 0));
+
+    cv1 = nullptr;
+    cv2 = nullptr;
+    unregister_module("cv1");
+    unregister_module("cv2");
 }
 
 
@@ -188,17 +737,63 @@ SPPImpl::~SPPImpl()
 
 torch::Tensor SPPImpl::forward(torch::Tensor x)
 {
-    x = cv1(x);
+    if (torch::GradMode::is_enabled())
+    {
+        const torch::Tensor y0 = cv1(x);
+        std::vector<torch::Tensor> concat = { y0 };
+        for (int i = 0; i < m->size(); ++i)
+        {
+            concat.push_back(m[i]->as<torch::nn::MaxPool2d>()->forward(y0));
+        }
+        return cv2(torch::cat(concat, 1));
+    }
+
+    return cv2(ForwardConcat(x));
+}
+
+void SPPImpl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    cv2->ForwardInto(ForwardConcat(x), out);
+}
+
+torch::Tensor SPPImpl::ForwardConcat(const torch::Tensor& x)
+{
+    const int64_t hidden = cv1->GetConv()->options.out_channels();
+    torch::Tensor y = torch::empty({ x.size(0), hidden * static_cast<int64_t>(m->size() + 1), x.size(2), x.size(3) },
+        x.options().memory_format(x.suggest_memory_format()));
+
+    torch::Tensor y0 = y.narrow(1, 0, hidden);
+    cv1->ForwardInto(x, y0);
 
-    std::vector<torch::Tensor> concats(m->size() + 1);
-    concats[0] = x;
+    std::vector<int> kernel_sizes(m->size());
+    std::vector<torch::Tensor> pooled(m->size());
+    for (int i = 0; i < m->size(); ++i)
+    {
+        kernel_sizes[i] = m[i]->as<torch::nn::MaxPool2d>()->options.kernel_size()->at(0);
+        pooled[i] = y.narrow(1, (i + 1) * hidden, hidden);
+    }
 
+    // All pools are computed in a single pass if
+    // they are given with increasing odd sizes
+    bool pyramid = y.device().is_cpu();
     for (int i = 0; i < m->size(); ++i)
     {
-        concats[i + 1] = m[i]->as<torch::nn::MaxPool2d>()->forward(x);
+        pyramid &= kernel_sizes[i] % 2 == 1 && (i == 0 || kernel_sizes[i] > kernel_sizes[i - 1]);
+    }
+
+    if (pyramid)
+    {
+        MaxPoolPyramid(y0, kernel_sizes, pooled);
+    }
+    else
+    {
+        for (int i = 0; i < m->size(); ++i)
+        {
+            pooled[i].copy_(m[i]->as<torch::nn::MaxPool2d>()->forward(y0));
+        }
     }
 
-    return cv2(torch::cat(concats, 1));
+    return y;
 }
 
 
@@ -222,15 +817,53 @@ SPPFImpl::~SPPFImpl()
 
 torch::Tensor SPPFImpl::forward(torch::Tensor x)
 {
-    x = cv1(x);
+    if (torch::GradMode::is_enabled())
+    {
+        const torch::Tensor y0 = cv1(x);
+        const torch::Tensor y1 = m(y0);
+        const torch::Tensor y2 = m(y1);
+        return cv2(torch::cat({ y0, y1, y2, m(y2) }, 1));
+    }
 
-    std::vector<torch::Tensor> concats(4);
-    concats[0] = x;
-    concats[1] = m(x);
-    concats[2] = m(concats[1]);
-    concats[3] = m(concats[2]);
+    return cv2(ForwardConcat(x));
+}
 
-    return cv2(torch::cat(concats, 1));
+void SPPFImpl::ForwardInto(const torch::Tensor& x, torch::Tensor out)
+{
+    cv2->ForwardInto(ForwardConcat(x), out);
+}
+
+torch::Tensor SPPFImpl::ForwardConcat(const torch::Tensor& x)
+{
+    const int64_t hidden = cv1->GetConv()->options.out_channels();
+    torch::Tensor y = torch::empty({ x.size(0), 4 * hidden, x.size(2), x.size(3) },
+        x.options().memory_format(x.suggest_memory_format()));
+
+    torch::Tensor previous = y.narrow(1, 0, hidden);
+    cv1->ForwardInto(x, previous);
+
+    const int kernel_size = m->options.kernel_size()->at(0);
+    if (y.device().is_cpu() && kernel_size % 2 == 1)
+    {
+        // Cascaded k pools are k, 2k - 1 and 3k - 2 pools
+        // of the input, all computed in a single pass
+        std::vector<torch::Tensor> pooled = {
+            y.narrow(1, hidden, hidden),
+            y.narrow(1, 2 * hidden, hidden),
+            y.narrow(1, 3 * hidden, hidden)
+        };
+        MaxPoolPyramid(previous, { kernel_size, 2 * kernel_size - 1, 3 * kernel_size - 2 }, pooled);
+        return y;
+    }
+
+    for (int i = 1; i < 4; ++i)
+    {
+        torch::Tensor current = y.narrow(1, i * hidden, hidden);
+        current.copy_(m(previous));
+        previous = current;
+    }
+
+    return y;
 }
 
 
@@ -286,15 +919,10 @@ torch::Tensor DetectImpl::forward(std::vector<torch::Tensor> x)
 
     for (int i = 0; i < num_detection_layers; ++i)
     {
-        x[i] = m[i]->as<torch::nn::Conv2d>()->forward(x[i]);
-        const auto shape = x[i].sizes();
-        const int batch_size = shape[0];
-        const int n_y = shape[2];
-        const int n_x = shape[3];
-        x[i] = x[i]
-            .view({ batch_size, num_anchors, num_output_per_anchor, n_y, n_x })
-            .permute({ 0, 1, 3, 4, 2 })
-            .contiguous();
+        x[i] = ForwardLayer(i, x[i]).contiguous();
+        const int batch_size = x[i].size(0);
+        const int n_y = x[i].size(2);
+        const int n_x = x[i].size(3);
 
         // Apply the grid transformation to the data
         if (grid[i].sizes()[2] != x[i].sizes()[2] ||
@@ -303,11 +931,22 @@ torch::Tensor DetectImpl::forward(std::vector<torch::Tensor> x)
             grid[i] = make_grid(n_x, n_y).to(x[i].device());
         }
 
-        torch::Tensor y = x[i].sigmoid();
-        y.index({ "...", torch::indexing::Slice(0, 2) }) =
-            (y.index({ "...", torch::indexing::Slice(0, 2) }) * 2.0f - 0.5f + grid[i]) * stride[i];
-        y.index({ "...", torch::indexing::Slice(2, 4) }) =
-            (y.index({ "...", torch::indexing::Slice(2, 4) }) * 2.0f).pow(2) * anchor_grid[i];
+        torch::Tensor y;
+        if (!torch::GradMode::is_enabled())
+        {
+            // x[i] is a new tensor, decode it in place
+            y = x[i].sigmoid_();
+            y.narrow(-1, 0, 2).mul_(2.0f).sub_(0.5f).add_(grid[i]).mul_(stride[i]);
+            y.narrow(-1, 2, 2).mul_(2.0f).pow_(2).mul_(anchor_grid[i]);
+        }
+        else
+        {
+            y = x[i].sigmoid();
+            y.index({ "...", torch::indexing::Slice(0, 2) }) =
+                (y.index({ "...", torch::indexing::Slice(0, 2) }) * 2.0f - 0.5f + grid[i]) * stride[i];
+            y.index({ "...", torch::indexing::Slice(2, 4) }) =
+                (y.index({ "...", torch::indexing::Slice(2, 4) }) * 2.0f).pow(2) * anchor_grid[i];
+        }
 
         z.push_back(y.view({ batch_size, -1, num_output_per_anchor }));
     }
@@ -315,6 +954,101 @@ torch::Tensor DetectImpl::forward(std::vector<torch::Tensor> x)
     return torch::cat(z, 1);
 }
 
+std::vector<torch::Tensor> DetectImpl::ForwardCandidates(const std::vector<torch::Tensor>& x, const float conf_threshold)
+{
+    // conf = sigmoid(obj) * sigmoid(cls) <= sigmoid(obj), so anchors
+    // with sigmoid(obj) <= conf_threshold can be discarded before
+    // any sigmoid, comparing the raw output with logit(conf_threshold)
+    // logit is only defined on ]0, 1[, thresholds outside keep all or no anchors
+    float obj_logit_threshold;
+    if (conf_threshold <= 0.0f)
+    {
+        obj_logit_threshold = -std::numeric_limits<float>::infinity();
+    }
+    else if (conf_threshold >= 1.0f)
+    {
+        obj_logit_threshold = std::numeric_limits<float>::infinity();
+    }
+    else
+    {
+        obj_logit_threshold = std::log(conf_threshold / (1.0f - conf_threshold));
+    }
+
+    const int batch_size = x[0].size(0);
+    std::vector<torch::Tensor> candidates;
+    std::vector<torch::Tensor> candidates_image;
+    candidates.reserve(num_detection_layers);
+    candidates_image.reserve(num_detection_layers);
+
+    for (int i = 0; i < num_detection_layers; ++i)
+    {
+        torch::Tensor y = ForwardLayer(i, x[i]);
+
+        // [K, 4 (batch, anchor, y, x)]
+        torch::Tensor indices = (y.select(-1, 4) > obj_logit_threshold).nonzero();
+        if (indices.size(0) == 0)
+        {
+            continue;
+        }
+        // [K, num output per anchor]
+        torch::Tensor kept = y.index({ indices.select(1, 0), indices.select(1, 1), indices.select(1, 2), indices.select(1, 3) });
+
+        torch::Tensor cell = torch::stack({ indices.select(1, 3), indices.select(1, 2) }, 1).to(torch::kFloat);
+        torch::Tensor anchor = anchor_grid[i].view({ num_anchors, 2 }).to(kept.device()).index({ indices.select(1, 1) });
+
+        torch::Tensor xy = (kept.index({ torch::indexing::Slice(), torch::indexing::Slice(0, 2) }).sigmoid() * 2.0f - 0.5f + cell) * stride[i].item<float>();
+        torch::Tensor wh = (kept.index({ torch::indexing::Slice(), torch::indexing::Slice(2, 4) }).sigmoid() * 2.0f).pow(2) * anchor;
+
+        // sigmoid is increasing, so the best class can
+        // be found before applying it to the scores
+        torch::Tensor cls_logit, cls;
+        std::tie(cls_logit, cls) = kept.index({ torch::indexing::Slice(), torch::indexing::Slice(5, torch::indexing::None) }).max(1, true);
+        torch::Tensor conf = kept.index({ torch::indexing::Slice(), torch::indexing::Slice(4, 5) }).sigmoid() * cls_logit.sigmoid();
+
+        candidates.push_back(torch::cat({ xy - wh / 2.0f, xy + wh / 2.0f, conf, cls.to(torch::kFloat) }, 1));
+        candidates_image.push_back(indices.select(1, 0));
+    }
+
+    std::vector<torch::Tensor> outputs(batch_size, torch::zeros({ 0, 6 }, torch::TensorOptions().device(x[0].device())));
+    if (candidates.empty())
+    {
+        return outputs;
+    }
+
+    torch::Tensor all_candidates = torch::cat(candidates, 0);
+    torch::Tensor all_images = torch::cat(candidates_image, 0);
+    torch::Tensor above_threshold = all_candidates.select(1, 4) > conf_threshold;
+
+    for (int b = 0; b < batch_size; ++b)
+    {
+        outputs[b] = all_candidates.index({ above_threshold & (all_images == b) });
+    }
+
+    return outputs;
+}
+
+torch::Tensor DetectImpl::ForwardLayer(const int i, const torch::Tensor& x)
+{
+    // Box decoding is always done in fp32, whatever
+    // the precision used in the rest of the network
+    torch::Tensor y = m[i]->as<torch::nn::Conv2d>()->forward(x).to(torch::kFloat);
+    const int batch_size = y.size(0);
+    const int n_y = y.size(2);
+    const int n_x = y.size(3);
+    if (y.is_contiguous(torch::MemoryFormat::ChannelsLast))
+    {
+        // Data are already stored as [batch, y, x, anchor * output]
+        return y
+            .permute({ 0, 2, 3, 1 })
+            .view({ batch_size, n_y, n_x, num_anchors, num_output_per_anchor })
+            .permute({ 0, 3, 1, 2, 4 });
+    }
+
+    return y
+        .view({ batch_size, num_anchors, num_output_per_anchor, n_y, n_x })
+        .permute({ 0, 1, 3, 4, 2 });
+}
+
 torch::Tensor DetectImpl::make_grid(int n_x, int n_y)
 {
     std::vector<torch::Tensor> meshgrids = torch::meshgrid({ torch::arange(n_y), torch::arange(n_x) });
@@ -325,3 +1059,49 @@ void DetectImpl::SetStride(torch::Tensor stride_)
 {
     stride = stride_;
 }
+
+void DetectImpl::RestrictClasses(const std::vector<int>& classes)
+{
+    torch::NoGradGuard no_grad;
+
+    for (const int c : classes)
+    {
+        if (c < 0 || c >= num_class)
+        {
+            throw std::runtime_error("Invalid class index " + std::to_string(c) + " for Detect with " + std::to_string(num_class) + " classes");
+        }
+    }
+
+    // For each anchor, keep x, y, w, h, obj and the selected classes
+    std::vector<int64_t> rows;
+    rows.reserve(num_anchors * (classes.size() + 5));
+    for (int a = 0; a < num_anchors; ++a)
+    {
+        for (int j = 0; j < 5; ++j)
+        {
+            rows.push_back(a * num_output_per_anchor + j);
+        }
+        for (const int c : classes)
+        {
+            rows.push_back(a * num_output_per_anchor + 5 + c);
+        }
+    }
+
+    for (int i = 0; i < num_detection_layers; ++i)
+    {
+        torch::nn::Conv2dImpl* conv = m[i]->as<torch::nn::Conv2d>();
+        torch::Tensor indices = torch::tensor(rows, torch::TensorOptions().dtype(torch::kLong).device(conv->weight.device()));
+
+        conv->weight.set_data(conv->weight.index_select(0, indices).contiguous(conv->weight.suggest_memory_format()));
+        conv->bias.set_data(conv->bias.index_select(0, indices));
+        conv->options.out_channels(rows.size());
+    }
+
+    num_class = classes.size();
+    num_output_per_anchor = num_class + 5;
+}
+
+int DetectImpl::NumClass() const
+{
+    return num_class;
+}
@@ -0,0 +1,270 @@
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#include <WeightsLoading/memory_mapped_file.hpp>
+
+#include "YoloV5/snapshot.hpp"
+
+const static char snapshot_magic[8] = { 'Y', 'O', 'L', 'O', 'V', '5', 'S', 'N' };
+const static unsigned int snapshot_version = 1;
+const static size_t snapshot_alignment = 64;
+
+size_t AlignSnapshotOffset(const size_t offset)
+{
+    return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+}
+
+/// <summary>
+/// Helper to serialize the header of a snapshot
+/// </summary>
+class SnapshotWriter
+{
+public:
+    template<typename T>
+    void Write(const T& value)
+    {
+        const char* ptr = reinterpret_cast<const char*>(&value);
+        data.insert(data.end(), ptr, ptr + sizeof(T));
+    }
+
+    void Write(const std::vector<int>& values)
+    {
+        Write(static_cast<unsigned int>(values.size()));
+        for (const int v : values)
+        {
+            Write(v);
+        }
+    }
+
+    void Write(const std::string& value)
+    {
+        Write(static_cast<unsigned int>(value.size()));
+        data.insert(data.end(), value.begin(), value.end());
+    }
+
+    std::vector<char> data;
+};
+
+/// <summary>
+/// Helper to read the header of a snapshot from memory
+/// </summary>
+class SnapshotReader
+{
+public:
+    SnapshotReader(const char* data_, const size_t size_) : data(data_), size(size_), pos(0)
+    {
+    }
+
+    template<typename T>
+    T Read()
+    {
+        if (pos + sizeof(T) > size)
+        {
+            throw std::runtime_error("Unexpected end of snapshot file");
+        }
+        T output;
+        std::memcpy(&output, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return output;
+    }
+
+    std::vector<int> ReadIntVector()
+    {
+        std::vector<int> output(Read<unsigned int>());
+        for (size_t i = 0; i < output.size(); ++i)
+        {
+            output[i] = Read<int>();
+        }
+        return output;
+    }
+
+    std::string ReadString()
+    {
+        const unsigned int length = Read<unsigned int>();
+        if (pos + length > size)
+        {
+            throw std::runtime_error("Unexpected end of snapshot file");
+        }
+        std::string output(data + pos, length);
+        pos += length;
+        return output;
+    }
+
+private:
+    const char* data;
+    size_t size;
+    size_t pos;
+};
+
+std::vector<char> SerializeSnapshotHeader(const Snapshot& snapshot, const std::vector<size_t>& offsets)
+{
+    SnapshotWriter writer;
+
+    writer.data.insert(writer.data.end(), snapshot_magic, snapshot_magic + sizeof(snapshot_magic));
+    writer.Write(snapshot_version);
+    writer.Write(snapshot.num_in_channels);
+
+    writer.Write(static_cast<unsigned int>(snapshot.blocks.size()));
+    for (const BlockConfig& block : snapshot.blocks)
+    {
+        writer.Write(static_cast<int>(block.type));
+        writer.Write(block.depth);
+        writer.Write(block.channel_in);
+        writer.Write(block.channel_out);
+        writer.Write(block.from);
+        writer.Write(block.args);
+        writer.Write(static_cast<unsigned int>(block.anchors.size()));
+        for (const std::vector<int>& a : block.anchors)
+        {
+            writer.Write(a);
+        }
+    }
+
+    writer.Write(static_cast<unsigned int>(snapshot.strides.size()));
+    for (const float s : snapshot.strides)
+    {
+        writer.Write(s);
+    }
+
+    writer.Write(static_cast<unsigned int>(snapshot.tensors.size()));
+    for (size_t i = 0; i < snapshot.tensors.size(); ++i)
+    {
+        const torch::Tensor& t = snapshot.tensors[i].second;
+        writer.Write(snapshot.tensors[i].first);
+        writer.Write(static_cast<int>(t.scalar_type()));
+        writer.Write(static_cast<unsigned int>(t.dim()));
+        for (const int64_t s : t.sizes())
+        {
+            writer.Write(s);
+        }
+        writer.Write(static_cast<uint64_t>(offsets[i]));
+        writer.Write(static_cast<uint64_t>(t.numel() * t.element_size()));
+    }
+
+    return writer.data;
+}
+
+void WriteSnapshotFile(const std::string& path, const Snapshot& snapshot)
+{
+    std::vector<torch::Tensor> tensors;
+    tensors.reserve(snapshot.tensors.size());
+    for (const auto& p : snapshot.tensors)
+    {
+        tensors.push_back(p.second.cpu().contiguous());
+    }
+
+    // Serialize once with dummy offsets to get the header size,
+    // (all fields have a fixed size), then compute the real ones
+    std::vector<size_t> offsets(tensors.size(), 0);
+    size_t offset = AlignSnapshotOffset(SerializeSnapshotHeader(snapshot, offsets).size());
+    for (size_t i = 0; i < tensors.size(); ++i)
+    {
+        offsets[i] = offset;
+        offset = AlignSnapshotOffset(offset + tensors[i].numel() * tensors[i].element_size());
+    }
+    const std::vector<char> header = SerializeSnapshotHeader(snapshot, offsets);
+
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Can't open snapshot file " + path);
+    }
+
+    const std::vector<char> padding(snapshot_alignment, 0);
+
+    file.write(header.data(), header.size());
+    size_t written = header.size();
+    for (size_t i = 0; i < tensors.size(); ++i)
+    {
+        file.write(padding.data(), offsets[i] - written);
+        file.write(reinterpret_cast<const char*>(tensors[i].data_ptr()), tensors[i].numel() * tensors[i].element_size());
+        written = offsets[i] + tensors[i].numel() * tensors[i].element_size();
+    }
+
+    if (!file.good())
+    {
+        throw std::runtime_error("Error while writing snapshot file " + path);
+    }
+
+    file.close();
+}
+
+Snapshot ReadSnapshotFile(const std::string& path)
+{
+    std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(path);
+
+    SnapshotReader reader(file->Data(), file->Size());
+
+    char magic[sizeof(snapshot_magic)];
+    for (size_t i = 0; i < sizeof(snapshot_magic); ++i)
+    {
+        magic[i] = reader.Read<char>();
+    }
+    if (std::memcmp(magic, snapshot_magic, sizeof(snapshot_magic)) != 0)
+    {
+        throw std::runtime_error(path + " is not a YoloV5 snapshot file");
+    }
+
+    const unsigned int version = reader.Read<unsigned int>();
+    if (version != snapshot_version)
+    {
+        throw std::runtime_error("Unsupported snapshot version " + std::to_string(version));
+    }
+
+    Snapshot snapshot;
+    snapshot.num_in_channels = reader.Read<int>();
+
+    snapshot.blocks = std::vector<BlockConfig>(reader.Read<unsigned int>());
+    for (BlockConfig& block : snapshot.blocks)
+    {
+        block.type = static_cast<KnownBlock>(reader.Read<int>());
+        block.depth = reader.Read<int>();
+        block.channel_in = reader.Read<int>();
+        block.channel_out = reader.Read<int>();
+        block.from = reader.ReadIntVector();
+        block.args = reader.ReadIntVector();
+        block.anchors = std::vector<std::vector<int> >(reader.Read<unsigned int>());
+        for (std::vector<int>& a : block.anchors)
+        {
+            a = reader.ReadIntVector();
+        }
+    }
+
+    snapshot.strides = std::vector<float>(reader.Read<unsigned int>());
+    for (float& s : snapshot.strides)
+    {
+        s = reader.Read<float>();
+    }
+
+    snapshot.tensors.resize(reader.Read<unsigned int>());
+    for (auto& p : snapshot.tensors)
+    {
+        p.first = reader.ReadString();
+        const torch::Dtype dtype = static_cast<torch::Dtype>(reader.Read<int>());
+        std::vector<int64_t> sizes(reader.Read<unsigned int>());
+        for (int64_t& s : sizes)
+        {
+            s = reader.Read<int64_t>();
+        }
+        const uint64_t offset = reader.Read<uint64_t>();
+        const uint64_t num_bytes = reader.Read<uint64_t>();
+
+        int64_t numel = 1;
+        for (const int64_t s : sizes)
+        {
+            numel *= s;
+        }
+        if (numel * c10::elementSize(dtype) != num_bytes || offset + num_bytes > file->Size())
+        {
+            throw std::runtime_error("Corrupted tensor " + p.first + " in snapshot file");
+        }
+
+        // The deleter holds a reference to the mapping, so it is
+        // closed only when the last tensor using it is destroyed
+        p.second = torch::from_blob(const_cast<char*>(file->Data() + offset), sizes,
+            [file](void*) {}, torch::TensorOptions().dtype(dtype));
+    }
+
+    return snapshot;
+}
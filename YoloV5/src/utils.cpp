@@ -1,7 +1,105 @@
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+
+// SIMD kernels are compiled for their instruction set whatever the
+// build flags and selected at runtime depending on the CPU features
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define YOLOV5_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC allows any intrinsic without specific flags
+#define YOLOV5_TARGET(isa)
+#else
+#include <cpuid.h>
+#define YOLOV5_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
 
 #include "YoloV5/utils.hpp"
 
+namespace
+{
+    /// <summary>
+    /// SIMD instruction sets supported by the CPU and the OS
+    /// </summary>
+    struct CPUFeatures
+    {
+        bool f16c = false;
+        bool avx2 = false;
+        bool avx512f = false;
+    };
+
+    CPUFeatures DetectCPUFeatures()
+    {
+        CPUFeatures features;
+#ifdef YOLOV5_X86
+        unsigned int regs[4] = { 0, 0, 0, 0 };
+        unsigned int regs7[4] = { 0, 0, 0, 0 };
+        unsigned long long xcr0 = 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        const int max_leaf = info[0];
+        __cpuid(info, 1);
+        for (int k = 0; k < 4; ++k)
+        {
+            regs[k] = info[k];
+        }
+        if (max_leaf >= 7)
+        {
+            __cpuidex(info, 7, 0);
+            for (int k = 0; k < 4; ++k)
+            {
+                regs7[k] = info[k];
+            }
+        }
+        const bool osxsave = (regs[2] >> 27) & 1;
+        if (osxsave)
+        {
+            xcr0 = _xgetbv(0);
+        }
+#else
+        const unsigned int max_leaf = __get_cpuid_max(0, nullptr);
+        if (max_leaf >= 1)
+        {
+            __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+        }
+        if (max_leaf >= 7)
+        {
+            __cpuid_count(7, 0, regs7[0], regs7[1], regs7[2], regs7[3]);
+        }
+        const bool osxsave = (regs[2] >> 27) & 1;
+        if (osxsave)
+        {
+            unsigned int eax, edx;
+            __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            xcr0 = (static_cast<unsigned long long>(edx) << 32) | eax;
+        }
+#endif
+        // The OS must save the YMM (and ZMM) registers
+        const bool avx = ((regs[2] >> 28) & 1) && (xcr0 & 0x6) == 0x6;
+        const bool avx512_state = (xcr0 & 0xE6) == 0xE6;
+
+        features.f16c = avx && ((regs[2] >> 29) & 1);
+        features.avx2 = avx && ((regs7[1] >> 5) & 1);
+        features.avx512f = avx512_state && ((regs7[1] >> 16) & 1);
+#endif
+        return features;
+    }
+
+    const CPUFeatures& GetCPUFeatures()
+    {
+        static const CPUFeatures features = DetectCPUFeatures();
+        return features;
+    }
+}
+
 int make_divisible(const float x, const int div)
 {
     return std::ceil(x / div) * div;
@@ -22,109 +120,640 @@ torch::Tensor xywh2xyxy(torch::Tensor x)
     return output;
 }
 
-torch::Tensor nms_kernel(const torch::Tensor& boxes_, const torch::Tensor& scores_, const float iou_threshold)
+namespace
 {
-    torch::Tensor boxes = boxes_.cpu();
-    torch::Tensor scores = scores_.cpu();
-
-    if (boxes.size(0) == 0)
+    /// <summary>
+    /// Boxes of a NMS problem, in score order, stored as
+    /// structure of arrays. Each group of boxes that can
+    /// overlap starts on a 64 boxes boundary and is padded
+    /// with empty boxes up to the next boundary.
+    /// </summary>
+    struct NMSBoxes
     {
-        return torch::empty({ 0 }, torch::TensorOptions().dtype(torch::kLong));
-    }
+        std::vector<float> x1;
+        std::vector<float> y1;
+        std::vector<float> x2;
+        std::vector<float> y2;
+        std::vector<float> areas;
+        // Index of the box in the score order, -1 for padding
+        std::vector<int64_t> rank;
 
-    torch::Tensor x1_t = boxes.index({ torch::indexing::Slice(), 0 }).contiguous();
-    torch::Tensor y1_t = boxes.index({ torch::indexing::Slice(), 1 }).contiguous();
-    torch::Tensor x2_t = boxes.index({ torch::indexing::Slice(), 2 }).contiguous();
-    torch::Tensor y2_t = boxes.index({ torch::indexing::Slice(), 3 }).contiguous();
+        void resize(const size_t n)
+        {
+            x1.assign(n, 0.0f);
+            y1.assign(n, 0.0f);
+            x2.assign(n, 0.0f);
+            y2.assign(n, 0.0f);
+            areas.assign(n, 0.0f);
+            rank.assign(n, -1);
+        }
+    };
 
-    torch::Tensor areas_t = (x2_t - x1_t) * (y2_t - y1_t);
+    /// <summary>
+    /// Set the bits of removed[w] corresponding to the boxes of
+    /// [begin + 64 w, begin + 64 (w + 1)) with an IoU > iou_threshold
+    /// with box i, for all w in [first_word, num_words)
+    /// </summary>
+    using SuppressFunction = void(*)(const NMSBoxes& b, const size_t i, const size_t begin,
+        const size_t first_word, const size_t num_words, const float iou_threshold, uint64_t* removed);
 
-    // Get the sorted indices
-    torch::Tensor order_t = std::get<1>(scores.sort(0, true));
+    void SuppressScalar(const NMSBoxes& b, const size_t i, const size_t begin,
+        const size_t first_word, const size_t num_words, const float iou_threshold, uint64_t* removed)
+    {
+        const float x1 = b.x1[i];
+        const float y1 = b.y1[i];
+        const float x2 = b.x2[i];
+        const float y2 = b.y2[i];
+        const float area = b.areas[i];
 
-    const int64_t num_boxes = boxes.size(0);
+        for (size_t w = first_word; w < num_words; ++w)
+        {
+            const size_t block = begin + w * 64;
+            uint64_t mask = 0;
+            for (size_t j = block; j < block + 64; ++j)
+            {
+                const float intersection =
+                    std::max(0.0f, std::min(x2, b.x2[j]) - std::max(x1, b.x1[j])) *
+                    std::max(0.0f, std::min(y2, b.y2[j]) - std::max(y1, b.y1[j]));
 
-    torch::Tensor suppressed_t = torch::zeros({ num_boxes }, torch::TensorOptions().dtype(torch::kBool));
-    torch::Tensor kept_t = torch::zeros({ num_boxes }, torch::TensorOptions().dtype(torch::kLong));
+                if (intersection / (area + b.areas[j] - intersection) > iou_threshold)
+                {
+                    mask |= uint64_t(1) << (j - block);
+                }
+            }
+            removed[w] |= mask;
+        }
+    }
 
-    bool* suppressed = suppressed_t.data_ptr<bool>();
-    int64_t* kept = kept_t.data_ptr<int64_t>();
-    int64_t* order = order_t.data_ptr<int64_t>();
-    float* x1 = x1_t.data_ptr<float>();
-    float* y1 = y1_t.data_ptr<float>();
-    float* x2 = x2_t.data_ptr<float>();
-    float* y2 = y2_t.data_ptr<float>();
-    float* areas = areas_t.data_ptr<float>();
+#ifdef YOLOV5_X86
+    YOLOV5_TARGET("avx2")
+    void SuppressAVX2(const NMSBoxes& b, const size_t i, const size_t begin,
+        const size_t first_word, const size_t num_words, const float iou_threshold, uint64_t* removed)
+    {
+        const __m256 x1_i = _mm256_set1_ps(b.x1[i]);
+        const __m256 y1_i = _mm256_set1_ps(b.y1[i]);
+        const __m256 x2_i = _mm256_set1_ps(b.x2[i]);
+        const __m256 y2_i = _mm256_set1_ps(b.y2[i]);
+        const __m256 area_i = _mm256_set1_ps(b.areas[i]);
+        const __m256 threshold = _mm256_set1_ps(iou_threshold);
+        const __m256 zero = _mm256_setzero_ps();
 
-    int64_t num_to_keep = 0;
+        for (size_t w = first_word; w < num_words; ++w)
+        {
+            const size_t block = begin + w * 64;
+            uint64_t mask = 0;
+            for (size_t j = block; j < block + 64; j += 8)
+            {
+                const __m256 width = _mm256_max_ps(_mm256_sub_ps(_mm256_min_ps(x2_i, _mm256_loadu_ps(b.x2.data() + j)), _mm256_max_ps(x1_i, _mm256_loadu_ps(b.x1.data() + j))), zero);
+                const __m256 height = _mm256_max_ps(_mm256_sub_ps(_mm256_min_ps(y2_i, _mm256_loadu_ps(b.y2.data() + j)), _mm256_max_ps(y1_i, _mm256_loadu_ps(b.y1.data() + j))), zero);
+                const __m256 intersection = _mm256_mul_ps(width, height);
+                const __m256 iou = _mm256_div_ps(intersection, _mm256_sub_ps(_mm256_add_ps(area_i, _mm256_loadu_ps(b.areas.data() + j)), intersection));
+                mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(iou, threshold, _CMP_GT_OQ))) << (j - block);
+            }
+            removed[w] |= mask;
+        }
+    }
 
-    // For each box in score order
-    for (size_t i = 0; i < num_boxes; ++i)
+    YOLOV5_TARGET("avx512f")
+    void SuppressAVX512(const NMSBoxes& b, const size_t i, const size_t begin,
+        const size_t first_word, const size_t num_words, const float iou_threshold, uint64_t* removed)
     {
-        int64_t index = order[i];
+        const __m512 x1_i = _mm512_set1_ps(b.x1[i]);
+        const __m512 y1_i = _mm512_set1_ps(b.y1[i]);
+        const __m512 x2_i = _mm512_set1_ps(b.x2[i]);
+        const __m512 y2_i = _mm512_set1_ps(b.y2[i]);
+        const __m512 area_i = _mm512_set1_ps(b.areas[i]);
+        const __m512 threshold = _mm512_set1_ps(iou_threshold);
+        const __m512 zero = _mm512_setzero_ps();
 
-        if (suppressed[index])
+        for (size_t w = first_word; w < num_words; ++w)
         {
-            continue;
+            const size_t block = begin + w * 64;
+            uint64_t mask = 0;
+            for (size_t j = block; j < block + 64; j += 16)
+            {
+                const __m512 width = _mm512_max_ps(_mm512_sub_ps(_mm512_min_ps(x2_i, _mm512_loadu_ps(b.x2.data() + j)), _mm512_max_ps(x1_i, _mm512_loadu_ps(b.x1.data() + j))), zero);
+                const __m512 height = _mm512_max_ps(_mm512_sub_ps(_mm512_min_ps(y2_i, _mm512_loadu_ps(b.y2.data() + j)), _mm512_max_ps(y1_i, _mm512_loadu_ps(b.y1.data() + j))), zero);
+                const __m512 intersection = _mm512_mul_ps(width, height);
+                const __m512 iou = _mm512_div_ps(intersection, _mm512_sub_ps(_mm512_add_ps(area_i, _mm512_loadu_ps(b.areas.data() + j)), intersection));
+                mask |= static_cast<uint64_t>(_mm512_cmp_ps_mask(iou, threshold, _CMP_GT_OQ)) << (j - block);
+            }
+            removed[w] |= mask;
         }
+    }
+#endif
 
-        // Keep this one
-        kept[num_to_keep++] = index;
-
-        // For each other, check if IoU is < threshold
-        for (size_t j = i + 1; j < num_boxes; ++j)
+    SuppressFunction GetSuppressFunction()
+    {
+#ifdef YOLOV5_X86
+        if (GetCPUFeatures().avx512f)
         {
-            int64_t jndex = order[j];
+            return SuppressAVX512;
+        }
+        if (GetCPUFeatures().avx2)
+        {
+            return SuppressAVX2;
+        }
+#endif
+        return SuppressScalar;
+    }
+
+    /// <summary>
+    /// Greedy NMS on the boxes [begin, end) of b, in score order.
+    /// Suppression is stored as one bit per box.
+    /// </summary>
+    void NMSGroup(const NMSBoxes& b, const size_t begin, const size_t end, const float iou_threshold, std::vector<int64_t>& kept)
+    {
+        static const SuppressFunction suppress = GetSuppressFunction();
+
+        std::vector<uint64_t> removed((end - begin) / 64, 0);
 
-            if (suppressed[jndex])
+        for (size_t i = begin; i < end && b.rank[i] != -1; ++i)
+        {
+            const size_t local = i - begin;
+            if ((removed[local / 64] >> (local % 64)) & 1)
             {
                 continue;
             }
 
-            float intersection =
-                std::max(0.0f,
-                    std::min(x2[index], x2[jndex]) -
-                    std::max(x1[index], x1[jndex])
-                )
-                *
-                std::max(0.0f,
-                    std::min(y2[index], y2[jndex]) -
-                    std::max(y1[index], y1[jndex])
-                );
-
-            if (intersection / (areas[index] + areas[jndex] - intersection) > iou_threshold)
+            kept.push_back(b.rank[i]);
+
+            // Boxes before i in its block are also tested, but their
+            // bits are never read again, so no need to mask them out
+            suppress(b, i, begin, local / 64, removed.size(), iou_threshold, removed.data());
+        }
+    }
+}
+
+std::vector<int64_t> nms_kernel(const float* boxes, const size_t boxes_stride,
+    const float* scores, const size_t scores_stride,
+    const std::vector<int64_t>& indices, const float iou_threshold)
+{
+    const size_t num_boxes = indices.size();
+
+    // Indices of the boxes in decreasing score order
+    std::vector<int64_t> order(indices);
+    std::stable_sort(order.begin(), order.end(), [scores, scores_stride](const int64_t a, const int64_t b) {
+        return scores[a * scores_stride] > scores[b * scores_stride];
+        });
+
+    // Boxes can only suppress each other if their x ranges overlap.
+    // Sweep the boxes from left to right to split them in groups
+    // whose x ranges union are disjoint. Greedy NMS on each group
+    // gives exactly the same result as on all the boxes at once.
+    std::vector<int64_t> by_x(num_boxes);
+    for (size_t r = 0; r < num_boxes; ++r)
+    {
+        by_x[r] = r;
+    }
+    auto x1 = [&](const int64_t r) { return boxes[order[r] * boxes_stride + 0]; };
+    auto x2 = [&](const int64_t r) { return boxes[order[r] * boxes_stride + 2]; };
+    std::sort(by_x.begin(), by_x.end(), [&](const int64_t a, const int64_t b) { return x1(a) < x1(b); });
+
+    std::vector<size_t> group(num_boxes);
+    std::vector<size_t> group_size;
+    float group_x2 = -std::numeric_limits<float>::infinity();
+    for (const int64_t r : by_x)
+    {
+        // Touching boxes have a null intersection, which
+        // can only be suppressed with a negative threshold
+        if (group_size.empty() || (iou_threshold >= 0.0f && !(x1(r) < group_x2)))
+        {
+            group_size.push_back(0);
+            group_x2 = x2(r);
+        }
+        group[r] = group_size.size() - 1;
+        group_size.back() += 1;
+        group_x2 = std::max(group_x2, x2(r));
+    }
+
+    // Each group starts on a 64 boxes boundary
+    std::vector<size_t> group_begin(group_size.size() + 1, 0);
+    for (size_t g = 0; g < group_size.size(); ++g)
+    {
+        group_begin[g + 1] = group_begin[g] + (group_size[g] + 63) / 64 * 64;
+    }
+
+    NMSBoxes b;
+    b.resize(group_begin.back());
+    std::vector<size_t> group_end(group_begin.begin(), group_begin.end() - 1);
+    for (size_t r = 0; r < num_boxes; ++r)
+    {
+        const float* box = boxes + order[r] * boxes_stride;
+        const size_t j = group_end[group[r]]++;
+        b.x1[j] = box[0];
+        b.y1[j] = box[1];
+        b.x2[j] = box[2];
+        b.y2[j] = box[3];
+        b.areas[j] = (b.x2[j] - b.x1[j]) * (b.y2[j] - b.y1[j]);
+        b.rank[j] = r;
+    }
+
+    std::vector<int64_t> kept;
+    for (size_t g = 0; g < group_size.size(); ++g)
+    {
+        NMSGroup(b, group_begin[g], group_begin[g + 1], iou_threshold, kept);
+    }
+
+    // Kept boxes are returned in decreasing score order
+    std::sort(kept.begin(), kept.end());
+    for (int64_t& k : kept)
+    {
+        k = order[k];
+    }
+
+    return kept;
+}
+
+torch::Tensor nms_kernel(const torch::Tensor& boxes_, const torch::Tensor& scores_, const float iou_threshold)
+{
+    const int64_t num_boxes = boxes_.size(0);
+
+    if (num_boxes == 0)
+    {
+        return torch::empty({ 0 }, torch::TensorOptions().dtype(torch::kLong).device(boxes_.device()));
+    }
+
+    const torch::Tensor boxes = boxes_.to(torch::kCPU, torch::kFloat).contiguous();
+    const torch::Tensor scores = scores_.to(torch::kCPU, torch::kFloat).contiguous();
+
+    std::vector<int64_t> indices(num_boxes);
+    for (int64_t i = 0; i < num_boxes; ++i)
+    {
+        indices[i] = i;
+    }
+
+    std::vector<int64_t> kept = nms_kernel(boxes.data_ptr<float>(), 4, scores.data_ptr<float>(), 1, indices, iou_threshold);
+
+    return torch::tensor(kept, torch::TensorOptions().dtype(torch::kLong)).to(boxes_.device());
+}
+
+namespace
+{
+    /// <summary>
+    /// Max over a (2 * radius + 1) window along one dimension of
+    /// block, with size elements of channels floats, separated
+    /// by stride floats. Windows are clipped at the borders.
+    /// </summary>
+    inline void WindowMax(const float* src, float* dst, const int64_t count, const int64_t size,
+        const int64_t stride, const int64_t outer_stride, const int64_t channels, const int radius)
+    {
+        for (int64_t o = 0; o < count; ++o)
+        {
+            const float* src_line = src + o * outer_stride;
+            float* dst_line = dst + o * outer_stride;
+            for (int64_t i = 0; i < size; ++i)
             {
-                suppressed[jndex] = true;
+                const int64_t begin = std::max<int64_t>(0, i - radius);
+                const int64_t end = std::min<int64_t>(size - 1, i + radius);
+                float* out = dst_line + i * stride;
+                std::copy(src_line + begin * stride, src_line + begin * stride + channels, out);
+                for (int64_t j = begin + 1; j <= end; ++j)
+                {
+                    const float* in = src_line + j * stride;
+                    for (int64_t c = 0; c < channels; ++c)
+                    {
+                        out[c] = std::max(out[c], in[c]);
+                    }
+                }
             }
         }
     }
 
-    return kept_t.index({ torch::indexing::Slice(0, num_to_keep) }).to(boxes.device());
+    template<typename scalar_t>
+    void MaxPoolPyramidImpl(const torch::Tensor& x, const std::vector<int>& kernel_sizes, std::vector<torch::Tensor>& outputs)
+    {
+        // Number of channels processed together, stored
+        // last in the local buffers so the inner loops
+        // are vectorized whatever the tensors layout
+        constexpr int64_t block_channels = 16;
+
+        const int64_t N = x.size(0);
+        const int64_t C = x.size(1);
+        const int64_t H = x.size(2);
+        const int64_t W = x.size(3);
+        const int64_t num_blocks = (C + block_channels - 1) / block_channels;
+
+        const scalar_t* src = x.data_ptr<scalar_t>();
+        const torch::IntArrayRef src_strides = x.strides();
+
+        at::parallel_for(0, N * num_blocks, 1, [&](int64_t begin, int64_t end)
+            {
+                // [H, W, block_channels] buffers
+                std::vector<float> current(H * W * block_channels);
+                std::vector<float> tmp(H * W * block_channels);
+
+                for (int64_t t = begin; t < end; ++t)
+                {
+                    const int64_t n = t / num_blocks;
+                    const int64_t c0 = (t % num_blocks) * block_channels;
+                    const int64_t channels = std::min(block_channels, C - c0);
+
+                    for (int64_t h = 0; h < H; ++h)
+                    {
+                        for (int64_t w = 0; w < W; ++w)
+                        {
+                            const scalar_t* in = src + n * src_strides[0] + c0 * src_strides[1] + h * src_strides[2] + w * src_strides[3];
+                            float* out = current.data() + (h * W + w) * block_channels;
+                            for (int64_t c = 0; c < channels; ++c)
+                            {
+                                out[c] = static_cast<float>(in[c * src_strides[1]]);
+                            }
+                        }
+                    }
+
+                    int previous_radius = 0;
+                    for (size_t k = 0; k < kernel_sizes.size(); ++k)
+                    {
+                        // Max over a (2r + 1) square window is the max over
+                        // a (2(r - r') + 1) window of the max over (2r' + 1),
+                        // including at the borders
+                        const int radius = kernel_sizes[k] / 2 - previous_radius;
+                        previous_radius = kernel_sizes[k] / 2;
+
+                        // Rows then columns
+                        WindowMax(current.data(), tmp.data(), H, W, block_channels, W * block_channels, channels, radius);
+                        WindowMax(tmp.data(), current.data(), W, H, W * block_channels, block_channels, channels, radius);
+
+                        scalar_t* dst = outputs[k].data_ptr<scalar_t>();
+                        const torch::IntArrayRef dst_strides = outputs[k].strides();
+                        for (int64_t h = 0; h < H; ++h)
+                        {
+                            for (int64_t w = 0; w < W; ++w)
+                            {
+                                scalar_t* out = dst + n * dst_strides[0] + c0 * dst_strides[1] + h * dst_strides[2] + w * dst_strides[3];
+                                const float* in = current.data() + (h * W + w) * block_channels;
+                                for (int64_t c = 0; c < channels; ++c)
+                                {
+                                    out[c * dst_strides[1]] = static_cast<scalar_t>(in[c]);
+                                }
+                            }
+                        }
+                    }
+                }
+            });
+    }
 }
 
-void CopyRawDataToTensor(const std::vector<char>& src, torch::Tensor& dst)
+void MaxPoolPyramid(const torch::Tensor& x, const std::vector<int>& kernel_sizes, std::vector<torch::Tensor>& outputs)
 {
-    if (dst.is_floating_point())
+    if (!x.device().is_cpu() || x.dim() != 4 || outputs.size() != kernel_sizes.size())
+    {
+        throw std::runtime_error("MaxPoolPyramid requires a [N, C, H, W] CPU tensor and one output per kernel");
+    }
+    for (size_t k = 0; k < kernel_sizes.size(); ++k)
     {
-        // YoloV5 floating point tensors are saved with half precision
-        torch::Tensor target = torch::zeros_like(dst, torch::TensorOptions().dtype(torch::kF16).layout(torch::kStrided));
-        if (target.itemsize() * target.numel() != src.size())
+        if (kernel_sizes[k] % 2 == 0 || (k > 0 && kernel_sizes[k] <= kernel_sizes[k - 1]))
         {
-            throw std::runtime_error("Error trying to load raw data into tensor, sizes don't match");
+            throw std::runtime_error("MaxPoolPyramid kernel sizes must be odd and increasing");
+        }
+        if (outputs[k].sizes() != x.sizes() || outputs[k].scalar_type() != x.scalar_type())
+        {
+            throw std::runtime_error("MaxPoolPyramid outputs must have the same shape and type as the input");
+        }
+    }
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(torch::kHalf, torch::kBFloat16, x.scalar_type(), "MaxPoolPyramid", [&]
+        {
+            MaxPoolPyramidImpl<scalar_t>(x, kernel_sizes, outputs);
+        });
+}
+
+namespace
+{
+    void HalfToFloatScalar(const uint16_t* src, float* dst, const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = c10::detail::fp16_ieee_to_fp32_value(src[i]);
         }
+    }
+
+#ifdef YOLOV5_X86
+    YOLOV5_TARGET("avx,f16c")
+    void HalfToFloatF16C(const uint16_t* src, float* dst, const size_t n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+        }
+        HalfToFloatScalar(src + i, dst + i, n - i);
+    }
+
+    YOLOV5_TARGET("avx512f")
+    void HalfToFloatAVX512(const uint16_t* src, float* dst, const size_t n)
+    {
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(h));
+        }
+        HalfToFloatScalar(src + i, dst + i, n - i);
+    }
+#endif
+}
+
+void HalfToFloat(const uint16_t* src, float* dst, const size_t n)
+{
+#ifdef YOLOV5_X86
+    if (GetCPUFeatures().avx512f)
+    {
+        HalfToFloatAVX512(src, dst, n);
+        return;
+    }
+    if (GetCPUFeatures().f16c)
+    {
+        HalfToFloatF16C(src, dst, n);
+        return;
+    }
+#endif
+    HalfToFloatScalar(src, dst, n);
+}
+
+torch::Dtype StorageTypeToDtype(const StorageType type)
+{
+    switch (type)
+    {
+    case StorageType::Float:
+        return torch::kFloat;
+    case StorageType::Double:
+        return torch::kDouble;
+    case StorageType::Half:
+        return torch::kHalf;
+    case StorageType::BFloat16:
+        return torch::kBFloat16;
+    case StorageType::Long:
+        return torch::kLong;
+    case StorageType::Int:
+        return torch::kInt;
+    case StorageType::Short:
+        return torch::kShort;
+    case StorageType::Char:
+        return torch::kChar;
+    case StorageType::Byte:
+        return torch::kByte;
+    case StorageType::Bool:
+        return torch::kBool;
+    default:
+        throw std::runtime_error("Unknown storage type");
+    }
+}
 
-        std::copy(src.data(), src.data() + src.size(), reinterpret_cast<char*>(target.data_ptr()));
-        dst.set_data(target.to(torch::kFloat));
+StorageType DtypeToStorageType(const torch::Dtype type)
+{
+    switch (type)
+    {
+    case torch::kFloat:
+        return StorageType::Float;
+    case torch::kDouble:
+        return StorageType::Double;
+    case torch::kHalf:
+        return StorageType::Half;
+    case torch::kBFloat16:
+        return StorageType::BFloat16;
+    case torch::kLong:
+        return StorageType::Long;
+    case torch::kInt:
+        return StorageType::Int;
+    case torch::kShort:
+        return StorageType::Short;
+    case torch::kChar:
+        return StorageType::Char;
+    case torch::kByte:
+        return StorageType::Byte;
+    case torch::kBool:
+        return StorageType::Bool;
+    default:
+        return StorageType::Unknown;
+    }
+}
+
+/// <summary>
+/// Convert elements [begin, end) of target from raw bytes
+/// </summary>
+void ConvertRawData(const char* src, const torch::Dtype src_type, torch::Tensor& target, const int64_t begin, const int64_t end)
+{
+    if (target.scalar_type() == src_type)
+    {
+        const size_t element_size = target.element_size();
+        std::memcpy(reinterpret_cast<char*>(target.data_ptr()) + begin * element_size,
+            src, (end - begin) * element_size);
+    }
+    else if (src_type == torch::kHalf && target.scalar_type() == torch::kFloat)
+    {
+        HalfToFloat(reinterpret_cast<const uint16_t*>(src), target.data_ptr<float>() + begin, end - begin);
     }
     else
     {
-        torch::Tensor target = torch::zeros_like(dst, torch::TensorOptions().layout(torch::kStrided));
-        if (target.itemsize() * target.numel() != src.size())
+        // Any other conversion, let torch do it
+        torch::Tensor src_chunk = torch::from_blob(const_cast<char*>(src), { end - begin },
+            torch::TensorOptions().dtype(src_type));
+        target.view({ -1 }).narrow(0, begin, end - begin).copy_(src_chunk);
+    }
+}
+
+void CopyWeightsToTensors(PythonWeightsFile& weights, const std::vector<TensorInfo>& src, std::vector<torch::Tensor>& dst)
+{
+    if (src.size() != dst.size())
+    {
+        throw std::runtime_error("Error trying to load raw data into tensors, number of tensors don't match");
+    }
+
+    // Part of a tensor to convert
+    struct Chunk
+    {
+        size_t index;
+        int64_t begin;
+        int64_t end;
+    };
+
+    // Split all stored tensors in chunks of similar size,
+    // so big tensors are spread across all threads. Compressed
+    // ones can only be decompressed from the beginning, so
+    // they are processed as a whole.
+    const int64_t chunk_size = 1 << 16;
+    std::vector<Chunk> chunks;
+    std::vector<size_t> compressed;
+    std::vector<torch::Dtype> src_types(dst.size());
+    std::vector<torch::Tensor> targets(dst.size());
+    for (size_t i = 0; i < dst.size(); ++i)
+    {
+        if (dst[i].numel() != src[i].Numel())
         {
             throw std::runtime_error("Error trying to load raw data into tensor, sizes don't match");
         }
+        if (!src[i].IsContiguous())
+        {
+            throw std::runtime_error("Error trying to load raw data into tensor, source is not contiguous");
+        }
+        src_types[i] = StorageTypeToDtype(src[i].type);
+
+        // Write directly into the destination storage if we can
+        if (dst[i].device().is_cpu() && dst[i].is_contiguous())
+        {
+            targets[i] = dst[i];
+        }
+        else
+        {
+            targets[i] = torch::empty(dst[i].sizes(), torch::TensorOptions().dtype(dst[i].scalar_type()));
+        }
 
-        std::copy(src.data(), src.data() + src.size(), reinterpret_cast<char*>(target.data_ptr()));
-        dst.set_data(target);
+        if (weights.IsCompressed(src[i]))
+        {
+            compressed.push_back(i);
+            continue;
+        }
+
+        for (int64_t begin = 0; begin < dst[i].numel(); begin += chunk_size)
+        {
+            chunks.push_back({ i, begin, std::min(begin + chunk_size, dst[i].numel()) });
+        }
+    }
+
+    at::parallel_for(0, compressed.size(), 1, [&](int64_t begin, int64_t end)
+        {
+            for (int64_t c = begin; c < end; ++c)
+            {
+                const size_t index = compressed[c];
+                const size_t src_element_size = c10::elementSize(src_types[index]);
+                weights.ReadTensor(src[index], [&](const char* data, const size_t offset, const size_t size)
+                    {
+                        ConvertRawData(data, src_types[index], targets[index],
+                            offset / src_element_size, (offset + size) / src_element_size);
+                    });
+            }
+        });
+
+    at::parallel_for(0, chunks.size(), 1, [&](int64_t chunk_begin, int64_t chunk_end)
+        {
+            for (int64_t c = chunk_begin; c < chunk_end; ++c)
+            {
+                const Chunk& chunk = chunks[c];
+
+                // Read only this part of the tensor, without
+                // any copy if the file is memory mapped
+                TensorInfo chunk_info;
+                chunk_info.type = src[chunk.index].type;
+                chunk_info.storage_key = src[chunk.index].storage_key;
+                chunk_info.storage_offset = src[chunk.index].storage_offset + chunk.begin;
+                chunk_info.shape = { chunk.end - chunk.begin };
+                chunk_info.stride = { 1 };
+
+                weights.ReadTensor(chunk_info, [&](const char* data, const size_t, const size_t)
+                    {
+                        ConvertRawData(data, src_types[chunk.index], targets[chunk.index], chunk.begin, chunk.end);
+                    });
+            }
+        });
+
+    for (size_t i = 0; i < dst.size(); ++i)
+    {
+        if (!targets[i].is_same(dst[i]))
+        {
+            dst[i].set_data(targets[i].to(dst[i].device()));
+        }
     }
 }
@@ -1,3 +1,14 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+
+#include <ATen/Parallel.h>
+
 #include <ryml_std.hpp>
 #include <ryml.hpp>
 
@@ -5,8 +16,37 @@
 
 #include "YoloV5/yolov5.hpp"
 #include "YoloV5/layers.hpp"
+#include "YoloV5/snapshot.hpp"
 #include "YoloV5/utils.hpp"
 
+float NMSOptions::MinConfThreshold() const
+{
+    float threshold = std::numeric_limits<float>::infinity();
+    bool all_classes_overridden = !classes.empty();
+
+    for (const int c : classes)
+    {
+        auto it = class_conf_thresholds.find(c);
+        if (it == class_conf_thresholds.end())
+        {
+            all_classes_overridden = false;
+        }
+        else
+        {
+            threshold = std::min(threshold, it->second);
+        }
+    }
+
+    if (classes.empty())
+    {
+        for (const auto& p : class_conf_thresholds)
+        {
+            threshold = std::min(threshold, p.second);
+        }
+    }
+
+    return all_classes_overridden ? threshold : std::min(threshold, conf_threshold);
+}
 
 YoloV5BlockImpl::YoloV5BlockImpl(const std::vector<int>& from_,
     const KnownBlock type_, torch::nn::Sequential seq_)
@@ -22,7 +62,7 @@ YoloV5BlockImpl::~YoloV5BlockImpl()
 {
 }
 
-torch::Tensor YoloV5BlockImpl::forward(std::vector<torch::Tensor> x)
+torch::Tensor YoloV5BlockImpl::forward(const std::vector<torch::Tensor>& x)
 {
     switch (type)
     {
@@ -34,6 +74,65 @@ torch::Tensor YoloV5BlockImpl::forward(std::vector<torch::Tensor> x)
     }
 }
 
+void YoloV5BlockImpl::ForwardInto(const std::vector<torch::Tensor>& x, torch::Tensor out)
+{
+    if (!CanForwardInto())
+    {
+        out.copy_(forward(x));
+        return;
+    }
+
+    // All modules but the last one are run as usual
+    torch::Tensor y = x[0];
+    auto it = seq->begin();
+    for (size_t j = 0; j + 1 < seq->size(); ++j, ++it)
+    {
+        y = it->forward(y);
+    }
+    const std::shared_ptr<torch::nn::Module> last = seq->ptr(seq->size() - 1);
+
+    switch (type)
+    {
+    case KnownBlock::Focus:
+        last->as<Focus>()->ForwardInto(y, out);
+        break;
+    case KnownBlock::Conv:
+        last->as<Conv>()->ForwardInto(y, out);
+        break;
+    case KnownBlock::C3:
+        last->as<C3>()->ForwardInto(y, out);
+        break;
+    case KnownBlock::SPP:
+        last->as<SPP>()->ForwardInto(y, out);
+        break;
+    case KnownBlock::SPPF:
+        last->as<SPPF>()->ForwardInto(y, out);
+        break;
+    case KnownBlock::Upsample:
+        // Only nearest mode is supported in BuildModules
+        torch::upsample_nearest2d_out(out, y, { out.size(2), out.size(3) });
+        break;
+    default:
+        break;
+    }
+}
+
+bool YoloV5BlockImpl::CanForwardInto() const
+{
+    switch (type)
+    {
+    case KnownBlock::Focus:
+    case KnownBlock::Conv:
+    case KnownBlock::C3:
+    case KnownBlock::SPP:
+    case KnownBlock::SPPF:
+    case KnownBlock::Upsample:
+        return !seq->is_empty();
+    default:
+        return false;
+    }
+}
+
 const std::vector<int>& YoloV5BlockImpl::From() const
 {
     return from;
@@ -49,12 +148,38 @@ const KnownBlock YoloV5BlockImpl::Type() const
 YoloV5Impl::YoloV5Impl(const std::string& config_path, const int num_in_channels_)
 {
     num_in_channels = num_in_channels_;
+    precision = torch::kFloat;
+    channels_last = false;
+    graph_fused = false;
+    raw_input = false;
     ParseConfig(config_path);
+    BuildModules();
     register_module("module_list", module_list);
     SetStride();
     InitWeights();
 }
 
+YoloV5Impl::YoloV5Impl(const std::string& snapshot_path)
+{
+    precision = torch::kFloat;
+    channels_last = false;
+    graph_fused = false;
+    raw_input = false;
+    LoadSnapshot(snapshot_path);
+}
+
+YoloV5Impl::YoloV5Impl(const std::vector<BlockConfig>& block_configs_, const int num_in_channels_)
+{
+    num_in_channels = num_in_channels_;
+    precision = torch::kFloat;
+    channels_last = false;
+    graph_fused = false;
+    raw_input = false;
+    block_configs = block_configs_;
+    BuildModules();
+    register_module("module_list", module_list);
+}
+
 YoloV5Impl::~YoloV5Impl()
 {
 
@@ -62,66 +187,456 @@ YoloV5Impl::~YoloV5Impl()
 
 torch::Tensor YoloV5Impl::forward(torch::Tensor x)
 {
-    std::vector<torch::Tensor> backbone_outputs = forward_backbone(x);
+    YoloV5BlockImpl* detect = module_list[module_list->size() - 1]->as<YoloV5Block>();
 
+    return detect->forward(forward_detect_inputs(x));
+}
+
+std::vector<torch::Tensor> YoloV5Impl::DetectCandidates(torch::Tensor x, float conf_threshold)
+{
     YoloV5BlockImpl* detect = module_list[module_list->size() - 1]->as<YoloV5Block>();
-    std::vector<torch::Tensor> detect_inputs(detect->From().size());
 
-    for (size_t i = 0; i < detect->From().size(); ++i)
+    if (detect->Type() != KnownBlock::Detect)
+    {
+        throw std::runtime_error("Last block of the network must be Detect to get candidates");
+    }
+
+    std::vector<torch::Tensor> candidates = detect->children()[0]->as<torch::nn::Sequential>()->at<DetectImpl>(0)
+        .ForwardCandidates(forward_detect_inputs(x), conf_threshold);
+
+    if (!class_map.empty())
     {
-        int c = detect->From()[i];
-        if (c < 0)
+        for (torch::Tensor& c : candidates)
         {
-            c = backbone_outputs.size() + c;
+            c.index_put_({ torch::indexing::Slice(), 5 }, MapClasses(c.index({ torch::indexing::Slice(), 5 })));
         }
-        detect_inputs[i] = backbone_outputs[c];
     }
 
-    return detect->forward(detect_inputs);
+    return candidates;
+}
+
+std::vector<torch::Tensor> YoloV5Impl::DetectCandidates(torch::Tensor x, const NMSOptions& options)
+{
+    return DetectCandidates(x, options.MinConfThreshold());
+}
+
+std::vector<torch::Tensor> YoloV5Impl::forward_detect_inputs(torch::Tensor x)
+{
+    std::vector<torch::Tensor> backbone_outputs = forward_backbone(x);
+
+    const std::vector<int>& detect_from = execution_plan.back().inputs;
+    std::vector<torch::Tensor> detect_inputs(detect_from.size());
+
+    for (size_t i = 0; i < detect_from.size(); ++i)
+    {
+        detect_inputs[i] = backbone_outputs[detect_from[i]];
+    }
+
+    return detect_inputs;
 }
 
 void YoloV5Impl::LoadWeights(const std::string& weights_file)
 {
-    PythonWeightsFile weights(weights_file);
+    const auto start = std::chrono::steady_clock::now();
+
+    // Map the file in memory so tensors are created
+    // directly from the archive bytes
+    PythonWeightsFile weights(weights_file, true);
+
+    // Gather all the tensors first so they
+    // can be converted in parallel
+    std::vector<TensorInfo> infos;
+    std::vector<torch::Tensor> tensors;
 
     size_t counter_params = 0;
     size_t counter_buffers = 0;
-    for (auto& submodule : modules())
+
+    // If data.pkl could be read, match the tensors by name
+    // and use their saved type, otherwise fall back to the
+    // order in which they appear in the archive
+    if (!weights.GetTensorInfos().empty())
     {
-        for (auto& p : submodule->parameters(false))
+        for (size_t i = 0; i < module_list->size(); ++i)
         {
-            CopyRawDataToTensor(weights.GetNextTensor(), p);
-            counter_params += 1;
-        }
+            YoloV5BlockImpl* block = module_list[i]->as<YoloV5Block>();
+
+            // In python, the sequential is only used if there are
+            // more than one module in it (depth > 1), and the modules
+            // are directly stored in the model otherwise
+            const bool python_seq = block->named_children()["seq"]->children().size() > 1;
 
-        for (auto& b : submodule->buffers(false))
+            for (int k = 0; k < 2; ++k)
+            {
+                const bool is_param = k == 0;
+                for (auto& t : is_param ? block->named_parameters(true) : block->named_buffers(true))
+                {
+                    // C++ names are seq.j.xxx, python ones model.i.j.xxx or model.i.xxx
+                    std::string local_name = t.key().substr(t.key().find('.') + 1);
+                    if (!python_seq)
+                    {
+                        local_name = local_name.substr(local_name.find('.') + 1);
+                    }
+                    const std::string name = "model." + std::to_string(i) + "." + local_name;
+
+                    // Full checkpoints store the model in a "model" field
+                    const TensorInfo* info = weights.FindTensor("model." + name);
+                    if (info == nullptr)
+                    {
+                        info = weights.FindTensor(name);
+                    }
+                    if (info == nullptr)
+                    {
+                        throw std::runtime_error("Can't find tensor " + name + " in " + weights_file);
+                    }
+                    if (info->shape != t.value().sizes().vec())
+                    {
+                        throw std::runtime_error("Shape mismatch for tensor " + name + " in " + weights_file);
+                    }
+
+                    infos.push_back(*info);
+                    tensors.push_back(t.value());
+                    counter_params += is_param;
+                    counter_buffers += !is_param;
+                }
+            }
+        }
+    }
+    else
+    {
+        for (auto& submodule : modules())
         {
-            CopyRawDataToTensor(weights.GetNextTensor(), b);
-            counter_buffers += 1;
+            // YoloV5 floating point tensors are saved with half precision
+            for (auto& p : submodule->parameters(false))
+            {
+                infos.push_back(weights.GetNextTensorInfo(p.is_floating_point() ? StorageType::Half : DtypeToStorageType(p.scalar_type())));
+                tensors.push_back(p);
+                counter_params += 1;
+            }
+
+            for (auto& b : submodule->buffers(false))
+            {
+                infos.push_back(weights.GetNextTensorInfo(b.is_floating_point() ? StorageType::Half : DtypeToStorageType(b.scalar_type())));
+                tensors.push_back(b);
+                counter_buffers += 1;
+            }
         }
     }
 
+    CopyWeightsToTensors(weights, infos, tensors);
+
+    const auto end = std::chrono::steady_clock::now();
+
     std::cout << counter_params << " parameter tensors successfully loaded" << std::endl;
     std::cout << counter_buffers << " buffer tensors successfully loaded" << std::endl;
+    std::cout << "Weights loaded in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << " ms using " << at::get_num_threads() << " threads" << std::endl;
 }
 
-std::vector<torch::Tensor> YoloV5Impl::NonMaxSuppression(torch::Tensor prediction, 
-    float conf_threshold, float iou_threshold)
+YoloV5 YoloV5Impl::Replicate() const
 {
-    const size_t batch_size = prediction.size(0);
-    std::vector<torch::Tensor> outputs(batch_size, torch::zeros({0, 6}, torch::TensorOptions().device(prediction.device())));
+    YoloV5 replica(std::shared_ptr<YoloV5Impl>(new YoloV5Impl(block_configs, num_in_channels)));
 
-    torch::Tensor candidates = prediction.index({ "...", 4 }) > conf_threshold;
+    // Fuse the same convolutions so both networks
+    // have the same parameters
+    const std::vector<std::shared_ptr<torch::nn::Module> > src_modules = modules();
+    if (graph_fused)
+    {
+        // All convs are fused before FuseGraph
+        replica->apply([](torch::nn::Module& m)
+            {
+                if (auto* conv = m.as<Conv>())
+                {
+                    conv->RemoveBN();
+                }
+            });
+        replica->FuseGraph();
+    }
+    else
+    {
+        const std::vector<std::shared_ptr<torch::nn::Module> > dst_modules = replica->modules();
+        for (size_t i = 0; i < src_modules.size(); ++i)
+        {
+            const ConvImpl* src_conv = src_modules[i]->as<Conv>();
+            if (src_conv != nullptr && src_conv->IsFused())
+            {
+                dst_modules[i]->as<Conv>()->RemoveBN();
+            }
+        }
+    }
+    const std::vector<std::shared_ptr<torch::nn::Module> > dst_modules = replica->modules();
 
-    for (size_t i = 0; i < batch_size; ++i)
+    if (!class_map.empty())
+    {
+        replica->RestrictClasses(class_map);
+    }
+
+    replica->strides = strides;
+    replica->SetDetectStride();
+    replica->precision = precision;
+    replica->channels_last = channels_last;
+    // Folded weights are shared
+    replica->raw_input = raw_input;
+
+    // Point all replica tensors to this network storage
+    auto share_tensors = [](const torch::OrderedDict<std::string, torch::Tensor>& src,
+        torch::OrderedDict<std::string, torch::Tensor>& dst)
+    {
+        if (src.size() != dst.size())
+        {
+            throw std::runtime_error("Error trying to replicate YoloV5, number of tensors don't match");
+        }
+        for (auto& t : dst)
+        {
+            const torch::Tensor& src_tensor = src[t.key()];
+            if (src_tensor.sizes() != t.value().sizes())
+            {
+                throw std::runtime_error("Error trying to replicate YoloV5, shape mismatch for tensor " + t.key());
+            }
+            t.value().set_data(src_tensor);
+        }
+    };
+
+    torch::OrderedDict<std::string, torch::Tensor> replica_parameters = replica->named_parameters();
+    torch::OrderedDict<std::string, torch::Tensor> replica_buffers = replica->named_buffers();
+    share_tensors(named_parameters(), replica_parameters);
+    share_tensors(named_buffers(), replica_buffers);
+
+    // Quantized weights are computed from the shared
+    // ones, prepacked weights are shared directly
+    for (size_t i = 0; i < src_modules.size(); ++i)
+    {
+        const ConvImpl* src_conv = src_modules[i]->as<Conv>();
+        if (src_conv != nullptr && src_conv->GetInt8Mode() == Int8Mode::Enabled)
+        {
+            dst_modules[i]->as<Conv>()->SetInt8Params(src_conv->GetInt8Params());
+            dst_modules[i]->as<Conv>()->SetInt8Mode(Int8Mode::Enabled);
+        }
+        if (src_conv != nullptr && src_conv->IsPrepacked())
+        {
+            dst_modules[i]->as<Conv>()->SetPrepackedWeights(src_conv->GetPrepackedWeights());
+        }
+    }
+
+    replica->train(is_training());
+
+    return replica;
+}
+
+void YoloV5Impl::RestrictClasses(const std::vector<int>& classes)
+{
+    YoloV5BlockImpl* detect = module_list[module_list->size() - 1]->as<YoloV5Block>();
+
+    if (detect->Type() != KnownBlock::Detect)
+    {
+        throw std::runtime_error("Last block of the network must be Detect to restrict classes");
+    }
+
+    if (classes.empty())
+    {
+        throw std::runtime_error("At least one class must be kept");
+    }
+
+    if (classes == class_map)
+    {
+        return;
+    }
+
+    DetectImpl& detect_module = detect->children()[0]->as<torch::nn::Sequential>()->at<DetectImpl>(0);
+
+    // Convert the original indices to the current Detect ones
+    std::vector<int> indices(classes.size());
+    for (size_t i = 0; i < classes.size(); ++i)
+    {
+        if (class_map.empty())
+        {
+            indices[i] = classes[i];
+        }
+        else
+        {
+            auto it = std::find(class_map.begin(), class_map.end(), classes[i]);
+            if (it == class_map.end())
+            {
+                throw std::runtime_error("Class " + std::to_string(classes[i]) + " has already been removed from the network");
+            }
+            indices[i] = it - class_map.begin();
+        }
+    }
+
+    detect_module.RestrictClasses(indices);
+    class_map = classes;
+}
+
+torch::Tensor YoloV5Impl::MapClasses(const torch::Tensor& cls) const
+{
+    if (class_map.empty())
+    {
+        return cls.to(torch::kFloat32);
+    }
+
+    torch::Tensor map = torch::tensor(class_map, torch::TensorOptions().dtype(torch::kFloat32)).to(cls.device());
+    return map.index({ cls.to(torch::kLong) });
+}
+
+void YoloV5Impl::CalibrateInt8(const torch::Tensor& x)
+{
+    torch::NoGradGuard no_grad;
+
+    if (precision != torch::kFloat)
+    {
+        throw std::runtime_error("Int8 calibration requires a fp32 network");
+    }
+
+    if (!int8_validation_input.defined())
     {
-        torch::Tensor x = prediction[i].index({ candidates[i] });
+        apply([](torch::nn::Module& m)
+            {
+                if (auto* conv = m.as<Conv>())
+                {
+                    conv->SetInt8Mode(Int8Mode::Calibration);
+                }
+            });
+        int8_validation_input = x.clone();
+    }
+
+    forward_backbone(x);
+}
 
-        // If no candidates, go to next image
-        if (!x.size(0))
+void YoloV5Impl::QuantizeInt8(const float max_error)
+{
+    torch::NoGradGuard no_grad;
+
+    if (!int8_validation_input.defined())
+    {
+        throw std::runtime_error("CalibrateInt8 must be called before QuantizeInt8");
+    }
+
+    std::vector<ConvImpl*> convs;
+    apply([&](torch::nn::Module& m)
+        {
+            if (auto* conv = m.as<Conv>())
+            {
+                conv->ComputeInt8Params();
+                conv->SetInt8Mode(Int8Mode::Validation);
+                convs.push_back(conv);
+            }
+        });
+
+    // Compare the int8 output of each layer to the fp32 one
+    forward_backbone(int8_validation_input);
+    int8_validation_input = torch::Tensor();
+
+    size_t num_int8 = 0;
+    for (ConvImpl* conv : convs)
+    {
+        if (conv->GetInt8Error() > max_error)
+        {
+            conv->SetInt8Mode(Int8Mode::Disabled);
+        }
+        else
+        {
+            conv->SetInt8Mode(Int8Mode::Enabled);
+            num_int8 += 1;
+        }
+    }
+
+    std::cout << num_int8 << "/" << convs.size() << " conv layers quantized to int8" << std::endl;
+}
+
+void YoloV5Impl::SaveInt8Params(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::out);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Can't open int8 params file " + path);
+    }
+
+    file << "# name int8 input_scale input_zero_point output_scale output_zero_point\n";
+    file << std::setprecision(17);
+    for (const auto& m : named_modules())
+    {
+        if (const ConvImpl* conv = m.value()->as<Conv>())
+        {
+            const ConvInt8Params& params = conv->GetInt8Params();
+            file << m.key() << " " << (conv->GetInt8Mode() == Int8Mode::Enabled) << " "
+                << params.input_scale << " " << params.input_zero_point << " "
+                << params.output_scale << " " << params.output_zero_point << "\n";
+        }
+    }
+
+    if (!file.good())
+    {
+        throw std::runtime_error("Error while writing int8 params file " + path);
+    }
+
+    std::cout << "Int8 params saved to " << path << std::endl;
+}
+
+void YoloV5Impl::LoadInt8Params(const std::string& path)
+{
+    std::ifstream file(path, std::ios::in);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Can't open int8 params file " + path);
+    }
+
+    std::map<std::string, std::pair<bool, ConvInt8Params> > params;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
         {
             continue;
         }
+        std::istringstream stream(line);
+        std::string name;
+        bool enabled;
+        ConvInt8Params p;
+        if (!(stream >> name >> enabled >> p.input_scale >> p.input_zero_point >> p.output_scale >> p.output_zero_point))
+        {
+            throw std::runtime_error("Corrupted line in int8 params file " + path + ": " + line);
+        }
+        params[name] = { enabled, p };
+    }
+
+    size_t num_int8 = 0;
+    size_t num_convs = 0;
+    for (const auto& m : named_modules())
+    {
+        if (ConvImpl* conv = m.value()->as<Conv>())
+        {
+            auto it = params.find(m.key());
+            if (it == params.end())
+            {
+                throw std::runtime_error("Can't find int8 params for " + m.key() + " in " + path);
+            }
+            num_convs += 1;
+            if (it->second.first)
+            {
+                conv->SetInt8Params(it->second.second);
+                conv->SetInt8Mode(Int8Mode::Enabled);
+                num_int8 += 1;
+            }
+            else
+            {
+                conv->SetInt8Mode(Int8Mode::Disabled);
+            }
+        }
+    }
+
+    std::cout << num_int8 << "/" << num_convs << " conv layers quantized to int8" << std::endl;
+}
+
+std::vector<torch::Tensor> YoloV5Impl::NonMaxSuppression(torch::Tensor prediction, 
+    float conf_threshold, float iou_threshold)
+{
+    const size_t batch_size = prediction.size(0);
+    std::vector<torch::Tensor> candidates(batch_size);
+
+    torch::Tensor above_threshold = prediction.index({ "...", 4 }) > conf_threshold;
+
+    for (size_t i = 0; i < batch_size; ++i)
+    {
+        torch::Tensor x = prediction[i].index({ above_threshold[i] });
 
         // Compute overall conf (obj_conf * cls_conf)
         x.index({ torch::indexing::Slice(), torch::indexing::Slice(5, torch::indexing::None) }) *=
@@ -132,22 +647,112 @@ std::vector<torch::Tensor> YoloV5Impl::NonMaxSuppression(torch::Tensor predictio
         torch::Tensor conf, j;
         std::tie(conf, j) = x.index({ torch::indexing::Slice(), torch::indexing::Slice(5, torch::indexing::None) }).max(1, true);
 
-        x = torch::cat({ box, conf, j.to(torch::kFloat32) }, 1).index({ conf.view({-1}) > conf_threshold });
+        candidates[i] = torch::cat({ box, conf, MapClasses(j) }, 1).index({ conf.view({-1}) > conf_threshold });
+    }
+
+    return NonMaxSuppression(candidates, iou_threshold);
+}
+
+std::vector<torch::Tensor> YoloV5Impl::NonMaxSuppression(const std::vector<torch::Tensor>& candidates,
+    float iou_threshold)
+{
+    NMSOptions options;
+    options.conf_threshold = -std::numeric_limits<float>::infinity();
+    options.iou_threshold = iou_threshold;
+    options.max_nms = std::numeric_limits<int>::max();
+    options.max_det = std::numeric_limits<int>::max();
+
+    return NonMaxSuppression(candidates, options);
+}
+
+std::vector<torch::Tensor> YoloV5Impl::NonMaxSuppression(const std::vector<torch::Tensor>& candidates,
+    const NMSOptions& options)
+{
+    // Boxes of one class in one image (or of all
+    // classes if agnostic), processed independently
+    struct NMSTask
+    {
+        size_t image;
+        std::vector<int64_t> indices;
+        std::vector<int64_t> kept;
+    };
+
+    std::vector<torch::Tensor> candidates_cpu(candidates.size());
+    std::vector<NMSTask> tasks;
+
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        candidates_cpu[i] = candidates[i].to(torch::kCPU, torch::kFloat).contiguous();
+        const float* x = candidates_cpu[i].data_ptr<float>();
 
-        // If no candidates, go to next image
-        if (!x.size(0))
+        // Filter boxes by class and confidence
+        std::vector<int64_t> selected;
+        selected.reserve(candidates_cpu[i].size(0));
+        for (int64_t j = 0; j < candidates_cpu[i].size(0); ++j)
         {
-            continue;
+            const int cls = static_cast<int>(x[6 * j + 5]);
+            if (!options.classes.empty() &&
+                std::find(options.classes.begin(), options.classes.end(), cls) == options.classes.end())
+            {
+                continue;
+            }
+            auto threshold = options.class_conf_thresholds.find(cls);
+            if (x[6 * j + 4] > (threshold == options.class_conf_thresholds.end() ? options.conf_threshold : threshold->second))
+            {
+                selected.push_back(j);
+            }
         }
 
-        // Spatially separate the classes so NMS is done per class
-        torch::Tensor boxes = x.index({ torch::indexing::Slice(), torch::indexing::Slice(torch::indexing::None, 4) })
-            + x.index({ torch::indexing::Slice(), torch::indexing::Slice(5,6) }) * 4096;
-        torch::Tensor scores = x.index({ torch::indexing::Slice(), 4 });
+        // Only keep the max_nms boxes with the highest scores
+        if (options.max_nms >= 0 && selected.size() > static_cast<size_t>(options.max_nms))
+        {
+            std::nth_element(selected.begin(), selected.begin() + options.max_nms, selected.end(),
+                [x](const int64_t a, const int64_t b) { return x[6 * a + 4] > x[6 * b + 4]; });
+            selected.resize(options.max_nms);
+        }
 
-        torch::Tensor indices = nms_kernel(boxes, scores, iou_threshold);
+        std::map<int, size_t> class_task;
+        for (const int64_t j : selected)
+        {
+            const int cls = options.agnostic ? 0 : static_cast<int>(x[6 * j + 5]);
+            auto it = class_task.find(cls);
+            if (it == class_task.end())
+            {
+                it = class_task.insert({ cls, tasks.size() }).first;
+                tasks.push_back(NMSTask{ i, {}, {} });
+            }
+            tasks[it->second].indices.push_back(j);
+        }
+    }
 
-        outputs[i] = x.index({ indices });
+    at::parallel_for(0, tasks.size(), 1, [&](int64_t begin, int64_t end)
+        {
+            for (int64_t t = begin; t < end; ++t)
+            {
+                const float* x = candidates_cpu[tasks[t].image].data_ptr<float>();
+                tasks[t].kept = nms_kernel(x, 6, x + 4, 6, tasks[t].indices, options.iou_threshold);
+            }
+        });
+
+    // Merge the kept boxes of all classes
+    std::vector<std::vector<int64_t> > kept(candidates.size());
+    for (const NMSTask& task : tasks)
+    {
+        kept[task.image].insert(kept[task.image].end(), task.kept.begin(), task.kept.end());
+    }
+
+    std::vector<torch::Tensor> outputs(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        // Keep the max_det boxes with the highest scores, in decreasing score order
+        const float* x = candidates_cpu[i].data_ptr<float>();
+        std::stable_sort(kept[i].begin(), kept[i].end(), [x](const int64_t a, const int64_t b) { return x[6 * a + 4] > x[6 * b + 4]; });
+        if (options.max_det >= 0 && kept[i].size() > static_cast<size_t>(options.max_det))
+        {
+            kept[i].resize(options.max_det);
+        }
+
+        outputs[i] = candidates[i].index({ torch::tensor(kept[i], torch::TensorOptions().dtype(torch::kLong)).to(candidates[i].device()) });
     }
 
     return outputs;
@@ -158,43 +763,300 @@ int YoloV5Impl::GetMaxStride() const
     return strides.max().item<float>();
 }
 
-void YoloV5Impl::FuseConvAndBN()
-{
+void YoloV5Impl::FuseConvAndBN()
+{
+    apply([](torch::nn::Module& m)
+        {
+            if (auto* conv = m.as<Conv>())
+            {
+                conv->FuseConvAndBN();
+            }
+        });
+    std::cout << "Batchnorms fused into convs" << std::endl;
+}
+
+void YoloV5Impl::FuseGraph()
+{
+    if (graph_fused)
+    {
+        return;
+    }
+
+    apply([](torch::nn::Module& m)
+        {
+            if (auto* conv = m.as<Conv>())
+            {
+                if (!conv->IsFused())
+                {
+                    throw std::runtime_error("FuseConvAndBN must be called before FuseGraph");
+                }
+            }
+        });
+
+    // Collect the modules first, as fusion changes the module tree
+    std::vector<std::shared_ptr<torch::nn::Module> > all_modules = modules();
+    for (const std::shared_ptr<torch::nn::Module>& m : all_modules)
+    {
+        if (auto* focus = m->as<Focus>())
+        {
+            focus->FuseSlicing();
+        }
+        else if (auto* c3 = m->as<C3>())
+        {
+            c3->FuseInputConvs();
+        }
+    }
+
+    graph_fused = true;
+    std::cout << "Graph fused" << std::endl;
+}
+
+void YoloV5Impl::SetPrecision(const torch::Dtype dtype)
+{
+    if (dtype != torch::kFloat && dtype != torch::kBFloat16 && dtype != torch::kHalf)
+    {
+        throw std::runtime_error("Unsupported precision for YoloV5, only fp32, bf16 and fp16 are available");
+    }
+
+    to(dtype);
+    precision = dtype;
+
+    ResetPrepackedWeights();
+}
+
+torch::Dtype YoloV5Impl::GetPrecision() const
+{
+    return precision;
+}
+
+void YoloV5Impl::SetChannelsLast(const bool channels_last_)
+{
+    const torch::MemoryFormat format = channels_last_ ? torch::MemoryFormat::ChannelsLast : torch::MemoryFormat::Contiguous;
+    for (auto& p : parameters())
+    {
+        if (p.dim() == 4)
+        {
+            p.set_data(p.contiguous(format));
+        }
+    }
+    channels_last = channels_last_;
+
+    ResetPrepackedWeights();
+}
+
+bool YoloV5Impl::IsChannelsLast() const
+{
+    return channels_last;
+}
+
+void YoloV5Impl::FoldInputNormalization()
+{
+    if (raw_input)
+    {
+        return;
+    }
+
+    YoloV5BlockImpl* first = module_list[0]->as<YoloV5Block>();
+    const std::shared_ptr<torch::nn::Module> first_module = first->children()[0]->as<torch::nn::Sequential>()->ptr(0);
+
+    // Input channel c of the network is channel C - 1 - c of the image
+    std::vector<int64_t> reversed_channels(num_in_channels);
+    for (int c = 0; c < num_in_channels; ++c)
+    {
+        reversed_channels[c] = num_in_channels - 1 - c;
+    }
+
+    if (auto* focus = first_module->as<Focus>())
+    {
+        focus->FoldInputTransform(reversed_channels, 1.0 / 255.0);
+    }
+    else if (auto* conv = first_module->as<Conv>())
+    {
+        conv->FoldInputTransform(reversed_channels, 1.0 / 255.0);
+    }
+    else
+    {
+        throw std::runtime_error("First block must be Focus or Conv to fold input normalization");
+    }
+
+    raw_input = true;
+}
+
+bool YoloV5Impl::IsRawInput() const
+{
+    return raw_input;
+}
+
+void YoloV5Impl::SetPrepacked(const bool prepacked)
+{
+    apply([prepacked](torch::nn::Module& m)
+        {
+            if (auto* conv = m.as<Conv>())
+            {
+                conv->SetPrepacked(prepacked);
+            }
+        });
+}
+
+void YoloV5Impl::ResetPrepackedWeights()
+{
+    apply([](torch::nn::Module& m)
+        {
+            if (auto* conv = m.as<Conv>())
+            {
+                conv->ResetPrepackedWeights();
+            }
+        });
+}
+
+void YoloV5Impl::SaveSnapshot(const std::string& snapshot_path, const torch::Dtype dtype)
+{
+    if (dtype != torch::kFloat && dtype != torch::kBFloat16 && dtype != torch::kHalf)
+    {
+        throw std::runtime_error("Unsupported snapshot type, only fp32, bf16 and fp16 are available");
+    }
+
+    if (!class_map.empty())
+    {
+        throw std::runtime_error("Can't save a snapshot of a network restricted to some classes");
+    }
+
+    if (graph_fused)
+    {
+        throw std::runtime_error("Can't save a snapshot of a network after FuseGraph");
+    }
+
+    if (raw_input)
+    {
+        throw std::runtime_error("Can't save a snapshot of a network with folded input normalization");
+    }
+
+    Snapshot snapshot;
+    snapshot.num_in_channels = num_in_channels;
+    snapshot.blocks = block_configs;
+
+    torch::Tensor s = strides.to(torch::kCPU, torch::kFloat).contiguous();
+    snapshot.strides = std::vector<float>(s.data_ptr<float>(), s.data_ptr<float>() + s.numel());
+
     apply([](torch::nn::Module& m)
         {
             if (auto* conv = m.as<Conv>())
             {
-                conv->FuseConvAndBN();
+                if (!conv->IsFused())
+                {
+                    throw std::runtime_error("FuseConvAndBN must be called before saving a snapshot");
+                }
             }
         });
-    std::cout << "Batchnorms fused into convs" << std::endl;
+
+    for (const auto& p : named_parameters())
+    {
+        snapshot.tensors.push_back({ p.key(), p.value().is_floating_point() ? p.value().detach().to(dtype) : p.value().detach() });
+    }
+    for (const auto& b : named_buffers())
+    {
+        snapshot.tensors.push_back({ b.key(), b.value().is_floating_point() ? b.value().to(dtype) : b.value() });
+    }
+
+    WriteSnapshotFile(snapshot_path, snapshot);
+
+    std::cout << "Snapshot saved to " << snapshot_path << std::endl;
 }
 
 std::vector<torch::Tensor> YoloV5Impl::forward_backbone(torch::Tensor x)
 {
+    if (x.scalar_type() != precision)
+    {
+        x = x.to(precision);
+    }
+
+    // Convs, concats, pooling and upsampling all keep
+    // the memory format of their input, so this is
+    // the only conversion needed
+    if (channels_last)
+    {
+        x = x.contiguous(torch::MemoryFormat::ChannelsLast);
+    }
+
+    if (x.sizes() != torch::IntArrayRef(plan_input_sizes))
+    {
+        ComputePlanSizes(x.sizes());
+    }
+    const torch::TensorOptions pool_options = x.options();
+
     std::vector<torch::Tensor> outputs(module_list->size() - 1);
+    // Concat outputs, allocated when the first of their
+    // inputs is computed, which writes directly in it
+    std::vector<torch::Tensor> concat_outputs(module_list->size() - 1);
+    // Output of the previous block, never stored in outputs
+    // unless a later block also needs it
+    torch::Tensor last = x;
+    // Writing in concat outputs and pooled buffers uses out= ops, which
+    // don't support autograd. With gradients, all blocks use forward and
+    // C3, SPP and SPPF concatenate their branches with torch::cat instead.
+    const bool in_place = !torch::GradMode::is_enabled();
 
     for (size_t i = 0; i < module_list->size() - 1; ++i)
     {
+        const ExecutionStep& step = execution_plan[i];
         YoloV5BlockImpl* block = module_list[i]->as<YoloV5Block>();
 
-        std::vector<torch::Tensor> inputs(block->From().size());
-        for (size_t j = 0; j < block->From().size(); ++j)
+        std::vector<torch::Tensor> inputs(step.inputs.size());
+        for (size_t j = 0; j < step.inputs.size(); ++j)
+        {
+            const int in = step.inputs[j];
+            inputs[j] = (in == -1 || in == static_cast<int>(i) - 1) ? last : outputs[in];
+        }
+
+        if (in_place && step.concat_slot != -1)
         {
-            if (block->From()[j] == -1)
+            torch::Tensor& concat_output = concat_outputs[step.concat_slot];
+            if (!concat_output.defined())
             {
-                inputs[j] = x;
+                concat_output = PooledActivation(step.concat_slot, pool_options);
             }
-            else
+            last = concat_output.narrow(1, step.concat_offset, step.output_sizes[1]);
+            block->ForwardInto(inputs, last);
+        }
+        else if (in_place && !step.input_offsets.empty())
+        {
+            // Only copy the inputs that could not be written in place
+            torch::Tensor& concat_output = concat_outputs[i];
+            if (!concat_output.defined())
             {
-                inputs[j] = outputs[block->From()[j]];
+                concat_output = PooledActivation(i, pool_options);
+            }
+            for (size_t j = 0; j < inputs.size(); ++j)
+            {
+                if (!step.input_in_place[j])
+                {
+                    concat_output.narrow(1, step.input_offsets[j], inputs[j].size(1)).copy_(inputs[j]);
+                }
             }
+            last = concat_output;
+            concat_output = torch::Tensor();
+        }
+        else if (in_place && step.pool_buffer != -1)
+        {
+            last = PooledActivation(i, pool_options);
+            block->ForwardInto(inputs, last);
+        }
+        else
+        {
+            last = block->forward(inputs);
+        }
+        inputs.clear();
+
+        if (step.save_output)
+        {
+            outputs[i] = last;
         }
-        x = block->forward(inputs);
 
-        if (save_module_output[i])
+        // Give the memory of the activations that
+        // won't be used anymore back to the allocator
+        for (const int r : step.release)
         {
-            outputs[i] = x;
+            outputs[r] = torch::Tensor();
         }
     }
 
@@ -237,7 +1099,8 @@ void YoloV5Impl::ParseConfig(const std::string& config_path)
     std::string module_name;
     ryml::NodeRef args;
 
-    save_module_output = std::vector<bool>(backbone.num_children() + head.num_children(), false);
+    block_configs.clear();
+    block_configs.reserve(backbone.num_children() + head.num_children());
 
     // That's a bit messy but the job is done \_("-")_/
     for (size_t i = 0; i < backbone.num_children() + head.num_children(); ++i)
@@ -265,127 +1128,109 @@ void YoloV5Impl::ParseConfig(const std::string& config_path)
 
         args = v[3];
 
-        int channel_out;
-        torch::nn::Sequential internal_seq;
-        KnownBlock module_type;
+        BlockConfig block;
+        block.from = from;
+        block.depth = block_depth;
+        block.channel_in = 0;
 
         if (module_name == "Concat")
         {
-            module_type = KnownBlock::Concat;
+            block.type = KnownBlock::Concat;
 
-            channel_out = 0;
+            block.channel_out = 0;
             for (auto c : from)
             {
                 if (c == -1)
                 {
                     c = output_channels.size() - 1;
                 }
-                channel_out += output_channels[c];
+                block.channel_out += output_channels[c];
             }
 
             int dimension;
             args[0] >> dimension;
-            for (size_t j = 0; j < block_depth; j++)
-            {
-                internal_seq->push_back(Concat(dimension));
-            }
+            block.args = { dimension };
         }
         else if (module_name == "Detect")
         {
-            module_type = KnownBlock::Detect;
-
-            channel_out = 0;
+            block.type = KnownBlock::Detect;
 
-            std::vector<int> output_convs;
-            output_convs.reserve(from.size());
+            block.channel_out = 0;
 
+            // First arg is the number of classes,
+            // then the input channels of each output conv
+            block.args = { num_class };
             for (auto c : from)
             {
                 if (c == -1)
                 {
                     c = output_channels.size() - 1;
                 }
-                output_convs.push_back(output_channels[c]);
-            }
-            for (size_t j = 0; j < block_depth; j++)
-            {
-                // We set the anchors from the yaml file to get the right
-                // tensor shape, but they will be overloaded with the ones
-                // saved in the .pt file anyway.
-                internal_seq->push_back(Detect(num_class, anchors, output_convs));
+                block.args.push_back(output_channels[c]);
             }
+
+            // We set the anchors from the yaml file to get the right
+            // tensor shape, but they will be overloaded with the ones
+            // saved in the .pt file anyway.
+            block.anchors = anchors;
         }
         else if (module_name == "nn.Upsample")
         {
-            int channel_in = 0;
             if (from[0] == -1)
             {
-                channel_in = output_channels[output_channels.size() - 1];
+                block.channel_in = output_channels[output_channels.size() - 1];
             }
             else
             {
-                channel_in = output_channels[from[0]];
+                block.channel_in = output_channels[from[0]];
             }
-            channel_out = channel_in;
+            block.channel_out = block.channel_in;
 
-            module_type = KnownBlock::Upsample;
+            block.type = KnownBlock::Upsample;
 
             double scale_factor;
             args[1] >> scale_factor;
             std::string mode;
             args[2] >> mode;
 
-            if (mode == "nearest")
-            {
-                for (size_t j = 0; j < block_depth; j++)
-                {
-                    internal_seq->push_back(
-                        torch::nn::Upsample(
-                            torch::nn::UpsampleOptions()
-                            .scale_factor(std::vector<double>({ scale_factor, scale_factor }))
-                            .mode(torch::kNearest)
-                    ));
-                }
-            }
-            else
+            // Block args (and snapshots) store integer factors only
+            if (scale_factor < 1.0 || scale_factor != std::floor(scale_factor))
             {
-                // TODO? Too lazy
+                throw std::runtime_error("Only integer Upsample scale factors are supported, got " + std::to_string(scale_factor));
             }
+
+            block.args = { static_cast<int>(scale_factor), mode == "nearest" };
         }
         else
         {
-            int channel_in = 0;
             if (from[0] == -1)
             {
-                channel_in = output_channels[output_channels.size() - 1];
+                block.channel_in = output_channels[output_channels.size() - 1];
             }
             else
             {
-                channel_in = output_channels[from[0]];
+                block.channel_in = output_channels[from[0]];
             }
 
-            args[0] >> channel_out;
-            if (channel_out != num_output)
+            args[0] >> block.channel_out;
+            if (block.channel_out != num_output)
             {
-                channel_out = make_divisible(channel_out * width_multiple, 8);
+                block.channel_out = make_divisible(block.channel_out * width_multiple, 8);
             }
 
-            // C3 is a bit special as the depth seq loop is already included
             if (module_name == "C3")
             {
-                module_type = KnownBlock::C3;
+                block.type = KnownBlock::C3;
                 bool shortcut = true;
                 if (args.num_children() > 1)
                 {
                     args[1] >> shortcut;
                 }
-
-                internal_seq->push_back(C3(channel_in, channel_out,
-                    block_depth, shortcut));
+                block.args = { shortcut };
             }
             else if (module_name == "Conv")
             {
-                module_type = KnownBlock::Conv;
+                block.type = KnownBlock::Conv;
                 int kernel_size, stride, padding;
                 args[1] >> kernel_size;
                 args[2] >> stride;
@@ -397,95 +1242,470 @@ void YoloV5Impl::ParseConfig(const std::string& config_path)
                 {
                     padding = -1;
                 }
-
-                for (size_t j = 0; j < block_depth; j++)
-                {
-                    internal_seq->push_back(Conv(channel_in, channel_out,
-                        kernel_size, stride, padding));
-                }
+                block.args = { kernel_size, stride, padding };
             }
             else if (module_name == "Focus")
             {
-                module_type = KnownBlock::Focus;
+                block.type = KnownBlock::Focus;
                 int kernel_size;
                 args[1] >> kernel_size;
+                block.args = { kernel_size };
+            }
+            else if (module_name == "SPP")
+            {
+                block.type = KnownBlock::SPP;
+                args[1] >> block.args;
+            }
+            else if (module_name == "SPPF")
+            {
+                block.type = KnownBlock::SPPF;
+                int kernel_size;
+                args[1] >> kernel_size;
+                block.args = { kernel_size };
+            }
+            else
+            {
+                throw std::runtime_error("Unknown module name in model file: " + module_name);
+            }
+        }
+
+        block_configs.push_back(block);
+
+        // Clean the initial num_in_channels in the output_channels
+        if (i == 0)
+        {
+            output_channels = {};
+        }
+        output_channels.push_back(block.channel_out);
+    }
+
+    std::cout << "Model successfully loaded from " << config_path << std::endl;
+}
+
+void YoloV5Impl::BuildModules()
+{
+    for (const BlockConfig& block : block_configs)
+    {
+        torch::nn::Sequential internal_seq;
 
-                for (size_t j = 0; j < block_depth; j++)
+        switch (block.type)
+        {
+        case KnownBlock::Concat:
+            for (size_t j = 0; j < block.depth; j++)
+            {
+                internal_seq->push_back(Concat(block.args[0]));
+            }
+            break;
+        case KnownBlock::Detect:
+        {
+            const std::vector<int> output_convs(block.args.begin() + 1, block.args.end());
+            for (size_t j = 0; j < block.depth; j++)
+            {
+                internal_seq->push_back(Detect(block.args[0], block.anchors, output_convs));
+            }
+            break;
+        }
+        case KnownBlock::Upsample:
+            if (block.args[1])
+            {
+                const double scale_factor = block.args[0];
+                for (size_t j = 0; j < block.depth; j++)
                 {
-                    internal_seq->push_back(Focus(channel_in, channel_out,
-                        kernel_size));
+                    internal_seq->push_back(
+                        torch::nn::Upsample(
+                            torch::nn::UpsampleOptions()
+                            .scale_factor(std::vector<double>({ scale_factor, scale_factor }))
+                            .mode(torch::kNearest)
+                    ));
                 }
             }
-            else if (module_name == "SPP")
+            else
+            {
+                // TODO? Too lazy
+            }
+            break;
+        // C3 is a bit special as the depth seq loop is already included
+        case KnownBlock::C3:
+            internal_seq->push_back(C3(block.channel_in, block.channel_out,
+                block.depth, block.args[0]));
+            break;
+        case KnownBlock::Conv:
+            for (size_t j = 0; j < block.depth; j++)
             {
-                module_type = KnownBlock::SPP;
-                std::vector<int> kernel_sizes;
-                args[1] >> kernel_sizes;
+                internal_seq->push_back(Conv(block.channel_in, block.channel_out,
+                    block.args[0], block.args[1], block.args[2]));
+            }
+            break;
+        case KnownBlock::Focus:
+            for (size_t j = 0; j < block.depth; j++)
+            {
+                internal_seq->push_back(Focus(block.channel_in, block.channel_out,
+                    block.args[0]));
+            }
+            break;
+        case KnownBlock::SPP:
+            for (size_t j = 0; j < block.depth; j++)
+            {
+                internal_seq->push_back(SPP(block.channel_in, block.channel_out,
+                    block.args));
+            }
+            break;
+        case KnownBlock::SPPF:
+            for (size_t j = 0; j < block.depth; j++)
+            {
+                internal_seq->push_back(SPPF(block.channel_in, block.channel_out,
+                    block.args[0]));
+            }
+            break;
+        }
 
-                for (size_t j = 0; j < block_depth; j++)
+        module_list->push_back(YoloV5Block(block.from, block.type, internal_seq));
+    }
+
+    BuildExecutionPlan();
+}
+
+void YoloV5Impl::BuildExecutionPlan()
+{
+    const int num_steps = block_configs.size();
+    execution_plan = std::vector<ExecutionStep>(num_steps);
+
+    // Step of the last block using each output
+    std::vector<int> last_use(num_steps, -1);
+
+    for (int i = 0; i < num_steps; ++i)
+    {
+        ExecutionStep& step = execution_plan[i];
+        step.save_output = false;
+        for (const int f : block_configs[i].from)
+        {
+            // -1 is the previous block, or the network input for the first one
+            const int in = f < 0 ? i + f : f;
+            if (in < -1 || in >= i)
+            {
+                throw std::runtime_error("Invalid input " + std::to_string(f) + " for block " + std::to_string(i));
+            }
+            step.inputs.push_back(in);
+            if (in > -1)
+            {
+                last_use[in] = std::max(last_use[in], i);
+                // Detect inputs are returned by forward_backbone, other
+                // inputs only need to be stored if not used by the next step
+                if (in != i - 1 || i == num_steps - 1)
                 {
-                    internal_seq->push_back(SPP(channel_in, channel_out,
-                        kernel_sizes));
+                    execution_plan[in].save_output = true;
                 }
             }
-            else if (module_name == "SPPF")
+        }
+    }
+
+    // Detect inputs are never released as they are the backbone outputs
+    for (int i = 0; i < num_steps; ++i)
+    {
+        if (execution_plan[i].save_output && last_use[i] < num_steps - 1)
+        {
+            execution_plan[last_use[i]].release.push_back(i);
+        }
+    }
+
+    // Blocks feeding a channel Concat write their output directly
+    // in its slice of the concat output, so no copy is needed
+    for (int i = 0; i < num_steps; ++i)
+    {
+        execution_plan[i].concat_slot = -1;
+        execution_plan[i].concat_offset = 0;
+    }
+    for (int c = 0; c < num_steps; ++c)
+    {
+        ExecutionStep& step = execution_plan[c];
+        step.input_in_place = std::vector<bool>(step.inputs.size(), false);
+
+        if (block_configs[c].type != KnownBlock::Concat || block_configs[c].args[0] != 1 || block_configs[c].depth != 1)
+        {
+            continue;
+        }
+
+        for (size_t j = 0; j < step.inputs.size(); ++j)
+        {
+            const int in = step.inputs[j];
+            // A block can only write in one concat output
+            if (in > -1 && execution_plan[in].concat_slot == -1 &&
+                module_list[in]->as<YoloV5Block>()->CanForwardInto() &&
+                std::count(step.inputs.begin(), step.inputs.end(), in) == 1)
             {
-                module_type = KnownBlock::SPPF;
-                int kernel_size;
-                args[1] >> kernel_size;
+                execution_plan[in].concat_slot = c;
+                step.input_in_place[j] = true;
+            }
+        }
+    }
+
+    plan_input_sizes.clear();
+}
+
+void YoloV5Impl::ComputePlanSizes(const torch::IntArrayRef input_sizes)
+{
+    auto conv_size = [](const int64_t size, const int kernel_size, const int stride, const int padding)
+    {
+        return (size + 2 * padding - kernel_size) / stride + 1;
+    };
 
-                for (size_t j = 0; j < block_depth; j++)
+    for (size_t i = 0; i < execution_plan.size(); ++i)
+    {
+        ExecutionStep& step = execution_plan[i];
+        const BlockConfig& block = block_configs[i];
+        const std::vector<int64_t>& in_sizes = step.inputs[0] == -1 ? input_sizes.vec() : execution_plan[step.inputs[0]].output_sizes;
+
+        int64_t height = in_sizes[2];
+        int64_t width = in_sizes[3];
+        switch (block.type)
+        {
+        case KnownBlock::Conv:
+        {
+            const int padding = block.args[2] == -1 ? block.args[0] / 2 : block.args[2];
+            for (int j = 0; j < block.depth; ++j)
+            {
+                height = conv_size(height, block.args[0], block.args[1], padding);
+                width = conv_size(width, block.args[0], block.args[1], padding);
+            }
+            break;
+        }
+        case KnownBlock::Focus:
+            for (int j = 0; j < block.depth; ++j)
+            {
+                height = conv_size((height + 1) / 2, block.args[0], 1, block.args[0] / 2);
+                width = conv_size((width + 1) / 2, block.args[0], 1, block.args[0] / 2);
+            }
+            break;
+        case KnownBlock::Upsample:
+            for (int j = 0; j < block.depth; ++j)
+            {
+                height *= block.args[0];
+                width *= block.args[0];
+            }
+            break;
+        default:
+            // Other blocks keep the spatial size
+            break;
+        }
+
+        step.output_sizes = { in_sizes[0], block.channel_out, height, width };
+
+        step.input_offsets.clear();
+        if (block.type == KnownBlock::Concat && block.args[0] == 1 && block.depth == 1)
+        {
+            int64_t offset = 0;
+            for (size_t j = 0; j < step.inputs.size(); ++j)
+            {
+                step.input_offsets.push_back(offset);
+                if (step.input_in_place[j])
                 {
-                    internal_seq->push_back(SPPF(channel_in, channel_out,
-                        kernel_size));
+                    execution_plan[step.inputs[j]].concat_offset = offset;
                 }
+                offset += step.inputs[j] == -1 ? input_sizes[1] : execution_plan[step.inputs[j]].output_sizes[1];
             }
-            else
+        }
+    }
+
+    // Steps (excluding Detect) during which each pooled output is alive.
+    // Concat outputs are alive from the first block writing in them.
+    const int num_steps = execution_plan.size() - 1;
+    std::vector<int> first_use(num_steps, -1);
+    std::vector<int> last_use(num_steps, -1);
+    for (int i = 0; i < num_steps; ++i)
+    {
+        const ExecutionStep& step = execution_plan[i];
+        const bool pooled = !step.input_offsets.empty() ||
+            (step.concat_slot == -1 && module_list[i]->as<YoloV5Block>()->CanForwardInto());
+        if (pooled)
+        {
+            first_use[i] = i;
+            last_use[i] = i;
+        }
+    }
+    for (int i = 0; i < num_steps; ++i)
+    {
+        const ExecutionStep& step = execution_plan[i];
+        if (step.concat_slot != -1)
+        {
+            first_use[step.concat_slot] = std::min(first_use[step.concat_slot], i);
+        }
+    }
+    // Outputs written in a concat slot keep the whole concat output
+    // alive. Detect inputs are returned by forward_backbone, alive
+    // until the end.
+    for (int i = 0; i <= num_steps; ++i)
+    {
+        for (const int in : execution_plan[i].inputs)
+        {
+            if (in == -1)
             {
-                throw std::runtime_error("Unknown module name in model file: " + module_name);
+                continue;
+            }
+            const int owner = execution_plan[in].concat_slot != -1 ? execution_plan[in].concat_slot : in;
+            if (first_use[owner] != -1)
+            {
+                last_use[owner] = std::max(last_use[owner], i);
             }
         }
+    }
+
+    // Greedy assignment by first use, with the smallest free buffer
+    // large enough, or the largest free one grown if none is
+    std::vector<int> order;
+    for (int i = 0; i < num_steps; ++i)
+    {
+        execution_plan[i].pool_buffer = -1;
+        if (first_use[i] != -1)
+        {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](const int a, const int b)
+        {
+            return first_use[a] < first_use[b];
+        });
+
+    pool_sizes.clear();
+    // Last step using each buffer
+    std::vector<int> buffer_end;
+    for (const int i : order)
+    {
+        const std::vector<int64_t>& sizes = execution_plan[i].output_sizes;
+        const int64_t numel = sizes[0] * sizes[1] * sizes[2] * sizes[3];
 
-        for (auto c : from)
+        int best = -1;
+        for (int b = 0; b < static_cast<int>(pool_sizes.size()); ++b)
         {
-            if (c != -1)
+            if (buffer_end[b] >= first_use[i])
+            {
+                continue;
+            }
+            if (best == -1 ||
+                (pool_sizes[b] >= numel && (pool_sizes[best] < numel || pool_sizes[b] < pool_sizes[best])) ||
+                (pool_sizes[b] < numel && pool_sizes[best] < numel && pool_sizes[b] > pool_sizes[best]))
             {
-                save_module_output[c] = true;
+                best = b;
             }
         }
+        if (best == -1)
+        {
+            best = pool_sizes.size();
+            pool_sizes.push_back(0);
+            buffer_end.push_back(-1);
+        }
+
+        pool_sizes[best] = std::max(pool_sizes[best], numel);
+        buffer_end[best] = last_use[i];
+        execution_plan[i].pool_buffer = best;
+    }
 
-        module_list->push_back(YoloV5Block(from, module_type, internal_seq));
+    activation_pool = std::vector<torch::Tensor>(pool_sizes.size());
+    plan_input_sizes = input_sizes.vec();
+}
 
-        // Clean the initial num_in_channels in the output_channels
-        if (i == 0)
+torch::Tensor YoloV5Impl::PooledActivation(const int step, const torch::TensorOptions& options)
+{
+    const ExecutionStep& s = execution_plan[step];
+    torch::Tensor& buffer = activation_pool[s.pool_buffer];
+    if (!buffer.defined() || buffer.dtype() != options.dtype() || buffer.device() != options.device())
+    {
+        buffer = torch::empty({ pool_sizes[s.pool_buffer] }, options);
+    }
+
+    const std::vector<int64_t>& sizes = s.output_sizes;
+    torch::Tensor output = buffer.narrow(0, 0, sizes[0] * sizes[1] * sizes[2] * sizes[3]);
+    if (channels_last)
+    {
+        return output.view({ sizes[0], sizes[2], sizes[3], sizes[1] }).permute({ 0, 3, 1, 2 });
+    }
+    return output.view(sizes);
+}
+
+void YoloV5Impl::LoadSnapshot(const std::string& snapshot_path)
+{
+    Snapshot snapshot = ReadSnapshotFile(snapshot_path);
+
+    num_in_channels = snapshot.num_in_channels;
+    block_configs = snapshot.blocks;
+    BuildModules();
+    register_module("module_list", module_list);
+
+    // Weights in the snapshot are already fused,
+    // we just need the right modules to store them
+    apply([](torch::nn::Module& m)
         {
-            output_channels = {};
+            if (auto* conv = m.as<Conv>())
+            {
+                conv->RemoveBN();
+            }
+        });
+
+    strides = torch::tensor(snapshot.strides, torch::kFloat32);
+    SetDetectStride();
+
+    // Run with the precision the weights were saved with
+    for (const auto& p : snapshot.tensors)
+    {
+        if (p.second.is_floating_point())
+        {
+            SetPrecision(p.second.scalar_type());
+            break;
         }
-        output_channels.push_back(channel_out);
     }
 
-    std::cout << "Model successfully loaded from " << config_path << std::endl;
+    std::map<std::string, torch::Tensor> tensors(snapshot.tensors.begin(), snapshot.tensors.end());
+
+    auto set_tensor = [&](const std::string& name, torch::Tensor& dst)
+    {
+        auto it = tensors.find(name);
+        if (it == tensors.end())
+        {
+            throw std::runtime_error("Can't find tensor " + name + " in snapshot file");
+        }
+        if (it->second.sizes() != dst.sizes())
+        {
+            throw std::runtime_error("Shape mismatch for tensor " + name + " in snapshot file");
+        }
+        // If the types are the same, the tensor directly
+        // uses the mapped memory, without any copy
+        dst.set_data(it->second.scalar_type() == dst.scalar_type() ? it->second : it->second.to(dst.scalar_type()));
+    };
+
+    for (auto& p : named_parameters())
+    {
+        set_tensor(p.key(), p.value());
+    }
+    for (auto& b : named_buffers())
+    {
+        set_tensor(b.key(), b.value());
+    }
+
+    std::cout << "Model successfully loaded from snapshot " << snapshot_path << std::endl;
 }
 
 void YoloV5Impl::SetStride()
 {
+    torch::NoGradGuard no_grad;
+
     int s = 256;
     torch::Tensor backbone_input = torch::zeros({ 1, num_in_channels, s, s });
     std::vector<torch::Tensor> backbone_outputs = forward_backbone(backbone_input);
 
-    YoloV5BlockImpl* detect = module_list[module_list->size() - 1]->as<YoloV5Block>();
-    strides = torch::zeros(detect->From().size());
+    const std::vector<int>& detect_from = execution_plan.back().inputs;
+    strides = torch::zeros(detect_from.size());
 
-    for (size_t i = 0; i < detect->From().size(); ++i)
+    for (size_t i = 0; i < detect_from.size(); ++i)
     {
-        int c = detect->From()[i];
-        if (c < 0)
-        {
-            c = backbone_outputs.size() + c;
-        }
-        strides[i] = s / backbone_outputs[c].size(-2);
+        strides[i] = s / backbone_outputs[detect_from[i]].size(-2);
     }
 
+    SetDetectStride();
+}
+
+void YoloV5Impl::SetDetectStride()
+{
+    YoloV5BlockImpl* detect = module_list[module_list->size() - 1]->as<YoloV5Block>();
+
     if (detect->Type() == KnownBlock::Detect)
     {
         detect->children()[0]->as<torch::nn::Sequential>()->at<DetectImpl>(0).SetStride(strides);